@@ -4,8 +4,11 @@
 #include <syslog.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "nlroute.h"
+#include "nlsampler.h"
 
 static int stats;
 
@@ -200,6 +203,8 @@ const char *nlr_iface_type2str(enum nlr_iface_type type)
 		[NLR_IFACE_TYPE_VLAN] = "vlan",
 		[NLR_IFACE_TYPE_BONDING] = "bonding",
 		[NLR_IFACE_TYPE_TUNNEL] = "tunnel",
+		[NLR_IFACE_TYPE_VXLAN] = "vxlan",
+		[NLR_IFACE_TYPE_MACVLAN] = "macvlan",
 	};
 	static char buf[32];
 
@@ -210,22 +215,60 @@ const char *nlr_iface_type2str(enum nlr_iface_type type)
 	return buf;
 }
 
+static void print_iface_options(struct nlr_iface *p, int n)
+{
+	struct in_addr a;
+
+	switch (p->type) {
+	case NLR_IFACE_TYPE_VLAN:
+		printf("%*s: %d\n", n, "vlan-id", p->options.vlan.id);
+		break;
+	case NLR_IFACE_TYPE_BONDING:
+		printf("%*s: %d\n", n, "bond-mode", p->options.bond.mode);
+		printf("%*s: %d\n", n, "miimon", p->options.bond.miimon);
+		break;
+	case NLR_IFACE_TYPE_VXLAN:
+		printf("%*s: %d\n", n, "vni", p->options.vxlan.vni);
+		if (p->options.vxlan.local) {
+			a.s_addr = p->options.vxlan.local;
+			printf("%*s: %s\n", n, "local", inet_ntoa(a));
+		}
+		if (p->options.vxlan.group) {
+			a.s_addr = p->options.vxlan.group;
+			printf("%*s: %s\n", n, "remote", inet_ntoa(a));
+		}
+		printf("%*s: %d\n", n, "dstport", p->options.vxlan.port);
+		break;
+	case NLR_IFACE_TYPE_MACVLAN:
+		printf("%*s: %d\n", n, "macvlan-mode", p->options.macvlan.mode);
+		break;
+	case NLR_IFACE_TYPE_BRIDGE:
+		printf("%*s: %s\n", n, "stp",
+			p->options.bridge.stp ? "on" : "off");
+		printf("%*s: %s\n", n, "vlan-filter",
+			p->options.bridge.vlan_filtering ? "on" : "off");
+		break;
+	default:
+		break;
+	}
+}
+
 static int get_iface_info(const char *iface_name)
 {
 	struct nlr_iface *iface, *p;
-	int iface_idx = -1, err, n;
+	int err, n;
 	char *master, *link;
 
 	if (iface_name) {
-		iface_idx = nlr_iface_idx(iface_name);
-		if (iface_idx < 0) {
+		iface = nlr_iface_by_name(iface_name, &err);
+		if (!iface) {
 			IFACE_IDX_FAILED(iface_name);
 			return -1;
 		}
+	} else {
+		iface = nlr_iface(-1, &err);
 	}
 
-	iface = nlr_iface(iface_idx, &err);
-
 	for (p = iface, n = 12; p; p = p->pnext) {
 		printf("\niface ");
 		if (p->link_idx >= 0) {
@@ -250,6 +293,7 @@ static int get_iface_info(const char *iface_name)
 		printf("%*s: %d\n", n, "idx", p->idx);
 
 		printf("%*s: %s\n", n, "type", nlr_iface_type2str(p->type));
+		print_iface_options(p, n);
 
 		if (p->mtu > 0)
 			printf("%*s: %d\n", n, "mtu", p->mtu);
@@ -284,6 +328,130 @@ static int get_iface_info(const char *iface_name)
 	return err;
 }
 
+/*
+ * ip -s link watch [IFACE]
+ */
+struct watch_ent {
+	int idx;
+	struct nlr_rates rates;
+};
+
+struct watch_priv {
+	int idx; /* <0 -- all */
+	struct watch_ent *v;
+	int n, size;
+};
+
+static int watch_cb(int idx, struct nlr_rates *rates, void *_priv)
+{
+	struct watch_priv *priv = _priv;
+	struct watch_ent *v;
+
+	if (priv->idx >= 0 && idx != priv->idx)
+		return 0;
+
+	if (priv->n == priv->size) {
+		v = realloc(priv->v, (priv->size + 64) * sizeof(*v));
+		if (!v)
+			return -1;
+		priv->v = v;
+		priv->size += 64;
+	}
+
+	priv->v[priv->n].idx = idx;
+	priv->v[priv->n].rates = *rates;
+	priv->n++;
+
+	return 0;
+}
+
+static int watch_ent_cmp(const void *a, const void *b)
+{
+	return ((struct watch_ent *)a)->idx - ((struct watch_ent *)b)->idx;
+}
+
+static const char *fmt_rate(double v, char *buf)
+{
+	static const char units[] = " KMGT";
+	int i;
+
+	for (i = 0; v >= 1000 && units[i + 1]; i++)
+		v /= 1000;
+
+	sprintf(buf, i ? "%.1f%c" : "%.0f", v, units[i]);
+
+	return buf;
+}
+
+static int watch_ifaces(const char *iface_name)
+{
+	struct nlr_sampler *sampler;
+	struct watch_priv priv;
+	struct pollfd pfd;
+	struct nlr_rates *r;
+	char *name, b[4][16];
+	int i;
+
+	memset(&priv, 0, sizeof(priv));
+	priv.idx = -1;
+	if (iface_name) {
+		priv.idx = nlr_iface_idx(iface_name);
+		if (priv.idx < 0) {
+			printf("No such iface\n");
+			return -1;
+		}
+	}
+
+	sampler = nlr_sampler_open(1000, 16, 4096, 0);
+	if (!sampler)
+		return -1;
+
+	pfd.fd = nlr_sampler_fd(sampler);
+	pfd.events = POLLIN;
+
+	while (1) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (nlr_sampler_poll(sampler))
+			break;
+		/* Names are looked up below, pick up renames once per round */
+		nlr_link_cache_sync();
+
+		priv.n = 0;
+		nlr_sampler_foreach(sampler, watch_cb, &priv);
+		qsort(priv.v, priv.n, sizeof(*priv.v), watch_ent_cmp);
+
+		printf("%-16s %10s %10s %10s %10s\n", "IFACE", "RX bps",
+		       "TX bps", "RX pps", "TX pps");
+		for (i = 0; i < priv.n; i++) {
+			name = nlr_iface_name(priv.v[i].idx);
+			r = &priv.v[i].rates;
+			printf("%-16s %10s %10s %10s %10s\n",
+			       name ? name : "?", fmt_rate(r->rx_bps, b[0]),
+			       fmt_rate(r->tx_bps, b[1]),
+			       fmt_rate(r->rx_pps, b[2]),
+			       fmt_rate(r->tx_pps, b[3]));
+			if (stats)
+				printf("%-16s %10s %10s %10s %10s\n", "  avg",
+				       fmt_rate(r->rx_bps_avg, b[0]),
+				       fmt_rate(r->tx_bps_avg, b[1]),
+				       fmt_rate(r->rx_pps_avg, b[2]),
+				       fmt_rate(r->tx_pps_avg, b[3]));
+			free(name);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	free(priv.v);
+	nlr_sampler_close(sampler);
+
+	return -1;
+}
+
 /*
  * For known code (>=0) return its name, for unknown code return
  * its numeric value. @t[] -- possible names, sparse array
@@ -392,6 +560,7 @@ static void print_route(struct nlr_route *r)
 {
 	struct in_addr in;
 	const char *oif;
+	int i;
 
 	/* Mimic "ip route" output */
 
@@ -401,13 +570,16 @@ static void print_route(struct nlr_route *r)
 			printf("%s", inet_ntoa(in));
 		else
 			printf("%s/%d", inet_ntoa(in), r->dest_plen);
-		if (r->gw) {
-			in.s_addr = r->gw;
-			printf(" via %s", inet_ntoa(in));
-		}
 	} else {
+		printf("default");
+	}
+
+	if (r->nh_id)
+		printf(" nhid %d", r->nh_id);
+
+	if (r->gw) {
 		in.s_addr = r->gw;
-		printf("default via %s", inet_ntoa(in));
+		printf(" via %s", inet_ntoa(in));
 	}
 
 	/*
@@ -422,11 +594,14 @@ static void print_route(struct nlr_route *r)
 	}
 	*/
 
-	oif = nlr_iface_name(r->oif);
-	printf(" dev %s", oif);
-	free((void *)oif);
+	if (r->oif) {
+		oif = nlr_iface_name(r->oif);
+		printf(" dev %s", oif);
+		free((void *)oif);
+	}
 
-	printf(" proto %s", CODE2NAME(r->proto, route_proto_name));
+	if (r->proto != RTPROT_UNSPEC)
+		printf(" proto %s", CODE2NAME(r->proto, route_proto_name));
 
 	if (r->scope != RT_SCOPE_UNIVERSE)
 		printf(" scope %s", CODE2NAME(r->scope, route_scope_name));
@@ -439,14 +614,20 @@ static void print_route(struct nlr_route *r)
 	if (r->flags & RTNH_F_LINKDOWN)
 		printf(" linkdown");
 	printf("\n");
-}
 
-/* 24 --> 255.255.255.0 */
-static unsigned netmask(int plen)
-{
-	if (!plen)
-		return 0;
-	return htonl(~0 << (32 - plen));
+	for (i = 0; i < r->n_nhs; i++) {
+		printf("\tnexthop");
+		if (r->nhs[i].gw) {
+			in.s_addr = r->nhs[i].gw;
+			printf(" via %s", inet_ntoa(in));
+		}
+		oif = nlr_iface_name(r->nhs[i].oif);
+		printf(" dev %s weight %d", oif, r->nhs[i].weight);
+		free((void *)oif);
+		if (r->nhs[i].flags & RTNH_F_LINKDOWN)
+			printf(" linkdown");
+		printf("\n");
+	}
 }
 
 static void init_route_filter(struct nlr_route *filter)
@@ -458,44 +639,55 @@ static void init_route_filter(struct nlr_route *filter)
 	filter->type = -1;
 	filter->scope = -1;
 	filter->proto = -1;
+	filter->oif = -1;
+	filter->prefsrc = INADDR_NONE;
 }
 
 static int get_route(const char *s_addr)
 {
-	struct nlr_route *r, *p, *q, filter;
-	int err;
+	struct nlr_route r;
 	in_addr_t addr;
 
 	addr = inet_addr(s_addr);
-	if (addr == INADDR_ANY) {
+	if (addr == INADDR_NONE) {
 		printf("Invalid address format\n");
 		return -1;
 	}
-	init_route_filter(&filter);
-	//filter.table = RT_TABLE_MAIN;
-	r = nlr_get_routes(&filter, &err);
-	if (err) {
-		nlr_free_routes(r);
+	if (nlr_route_lookup(addr, &r)) {
+		printf("No route to %s\n", s_addr);
 		return -1;
 	}
-	if (!r)
-		return 0;
-	for (p = r, q = NULL; p; p = p->pnext) {
-		if ((addr & netmask(p->dest_plen)) == p->dest) {
-			if (!q || p->dest_plen > q->dest_plen)
-				q = p;
-		}
+	print_route(&r);
+	return 0;
+}
+
+static int show_route_cb(struct nlr_route *r, void *priv)
+{
+	int mimic_iproute = *(int *)priv;
+
+	/*
+	 * If user doesn't specify a filter, then mimic "ip route
+	 * output".
+	 */
+	if (mimic_iproute) {
+		if (r->table != RT_TABLE_MAIN
+			&& r->table != RT_TABLE_LOCAL)
+			return 0;
+		if (r->type != RTN_UNICAST && r->type != RTN_LOCAL)
+			return 0;
+		if (r->scope != RT_SCOPE_UNIVERSE
+			&& r->scope != RT_SCOPE_LINK)
+			return 0;
 	}
-	if (q)
-		print_route(q);
-	nlr_free_routes(r);
+
+	print_route(r);
+
 	return 0;
 }
 
 static int show_routes(char *w[])
 {
-	int err;
-	struct nlr_route *h, *r, filter;
+	struct nlr_route filter;
 	int i, mimic_iproute = 1;
 	char **t;
 
@@ -597,33 +789,7 @@ static int show_routes(char *w[])
 	}
 w_processing_done:
 
-	h = nlr_get_routes(&filter, &err);
-	if (err)
-		return -1;
-
-	if (mimic_iproute) {
-		/*
-		 * If user doesn't specify a filter, then mimic "ip route
-		 * output".
-		 */
-		for (r = h; r; r = r->pnext) {
-			if (r->table != RT_TABLE_MAIN
-				&& r->table != RT_TABLE_LOCAL)
-				continue;
-			if (r->type != RTN_UNICAST && r->type != RTN_LOCAL)
-				continue;
-			if (r->scope != RT_SCOPE_UNIVERSE
-				&& r->scope != RT_SCOPE_LINK)
-				continue;
-			print_route(r);
-		}
-	} else {
-		for (r = h; r; r = r->pnext)
-			print_route(r);
-	}
-
-	nlr_free_routes(h);
-	return err;
+	return nlr_foreach_route(&filter, show_route_cb, &mimic_iproute);
 }
 
 static int manage_route(const char *dest, const char *gw,
@@ -654,12 +820,122 @@ static int del_route(const char *dest, const char *gw)
 	return manage_route(dest, gw, nlr_del_route);
 }
 
+static void mon_link(int deleted, struct nlr_iface *iface, void *priv)
+{
+	printf("%s%d: %s %s%s mtu %d\n", deleted ? "Deleted " : "",
+	       iface->idx, iface->name, iface->is_up ? "UP" : "DOWN",
+	       iface->carrier_on ? ",LOWER_UP" : "", iface->mtu);
+}
+
+static void mon_addr(int deleted, struct nlr_addr *addr, void *priv)
+{
+	struct in_addr in;
+	char *name;
+
+	name = nlr_iface_name(addr->iface_idx);
+	in.s_addr = addr->addr;
+	printf("%s%s %s/%d\n", deleted ? "Deleted " : "", name ? name : "",
+	       inet_ntoa(in), addr->prefix_len);
+	free(name);
+}
+
+static void mon_route(int deleted, struct nlr_route *route, void *priv)
+{
+	if (deleted)
+		printf("Deleted ");
+	print_route(route);
+}
+
+static void mon_neigh(int deleted, struct nlr_neigh *neigh, void *priv)
+{
+	struct in_addr in;
+	char *name;
+	unsigned char *a = neigh->lladdr;
+
+	name = nlr_iface_name(neigh->iface_idx);
+	in.s_addr = neigh->addr;
+	printf("%s%s dev %s lladdr %02x:%02x:%02x:%02x:%02x:%02x state 0x%x\n",
+	       deleted ? "Deleted " : "", inet_ntoa(in), name ? name : "",
+	       a[0], a[1], a[2], a[3], a[4], a[5], neigh->state);
+	free(name);
+}
+
+static int mon_group(const char *w, unsigned *groups)
+{
+	if (!strcmp(w, "link"))
+		*groups |= NLR_MON_LINK;
+	else if (!strcmp(w, "addr"))
+		*groups |= NLR_MON_ADDR;
+	else if (!strcmp(w, "route"))
+		*groups |= NLR_MON_ROUTE;
+	else if (!strcmp(w, "neigh"))
+		*groups |= NLR_MON_NEIGH;
+	else if (strcmp(w, "all"))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * ip monitor [link] [addr] [route] [neigh]
+ * @cmd is the first group ("show" if there are no groups).
+ */
+static int monitor(const char *cmd, char *w[])
+{
+	static const struct nlr_monitor_ops ops = {
+		.link = mon_link,
+		.addr = mon_addr,
+		.route = mon_route,
+		.neigh = mon_neigh,
+	};
+	struct nlr_monitor *mon;
+	struct pollfd pfd;
+	unsigned groups = 0;
+
+	if (strcmp(cmd, "show") && mon_group(cmd, &groups))
+		return 1;
+	for (; *w; w++) {
+		if (mon_group(*w, &groups))
+			return 1;
+	}
+	if (!groups)
+		groups = NLR_MON_LINK | NLR_MON_ADDR | NLR_MON_ROUTE
+			| NLR_MON_NEIGH;
+
+	/* On overrun the monitor resyncs and reports only the difference */
+	mon = nlr_monitor_open(groups | NLR_MON_SYNC, &ops, NULL);
+	if (!mon)
+		return -1;
+	nlr_monitor_set_rcvbuf(mon, 4 << 20);
+
+	pfd.fd = nlr_monitor_fd(mon);
+	pfd.events = POLLIN;
+
+	while (1) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		/* Printers look up iface names, sync them once per wakeup */
+		nlr_link_cache_sync();
+		if (nlr_monitor_dispatch(mon))
+			break;
+		fflush(stdout);
+	}
+
+	nlr_monitor_close(mon);
+
+	return -1;
+}
+
 static void help(void)
 {
 	printf("\nUsage: [OPTIONS] OBJECT CMD [CMD_OPTIONS]" \
 	       "\nOptions: -d -- debug, -h -- help" \
 	       " -s -- stats (show more detailed info),"
 	       "\n$ ip link [show [IFACE]]" \
+	       "\n$ ip [-s] link watch [IFACE]" \
 	       "\n$ ip link add IFACE type bridge" \
 	       "\n$ ip link add IFACE type vlan MASTER_IFACE VLAN_ID" \
 	       "\n$ ip link del IFACE" \
@@ -673,6 +949,7 @@ static void help(void)
 	       "\n$ ip route show all" \
 	       "\n$ ip route get ADDR" \
 	       "\n$ ip route add|del DEST/BITS via GW" \
+	       "\n$ ip monitor [all|link|addr|route|neigh]..." \
 	       "\n"
 	);
 }
@@ -744,6 +1021,10 @@ int main(int argc, char *argv[])
 			if (argv[0] && argv[1])
 				goto fin;
 			r = get_iface_info(argv[0]);
+		} else if (!strcmp(cmd, "watch")) {
+			if (argv[0] && argv[1])
+				goto fin;
+			r = watch_ifaces(argv[0]);
 		} else if (!strcmp(cmd, "set")) {
 			iface = argv[0];
 			if (!iface || !argv[1])
@@ -818,6 +1099,8 @@ int main(int argc, char *argv[])
 				goto fin;
 			r = del_route(argv[0], argv[2]);
 		}
+	} else if (!strcmp(obj, "monitor")) {
+		r = monitor(cmd, argv);
 	}
 
 fin:
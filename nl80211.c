@@ -11,6 +11,7 @@
 static struct nl_sock nlsock;
 static int nl80211_id;
 static int nl80211_initialized;
+static struct nl_arena *arena; /* See nl80211_set_arena() */
 
 int nl80211_init(void)
 {
@@ -43,6 +44,11 @@ void nl80211_fin(void)
 		--nl80211_initialized;
 }
 
+void nl80211_set_arena(struct nl_arena *a)
+{
+	arena = a;
+}
+
 void nl80211_iface_free(struct nl80211_iface *iface)
 {
 	struct nl80211_iface *p;
@@ -71,14 +77,20 @@ static int ieee80211_freq_to_channel(int freq)
 
 struct iface_cb_priv {
 	struct nl80211_iface *iface;
+	struct nl_arena *arena; /* NULL -- malloc() */
 	int idx;
 	int err;
 };
 
+static char *str_dup(struct nl_arena *a, const char *s, int len)
+{
+	return a ? nl_arena_strndup(a, s, len) : strndup(s, len);
+}
+
 static int iface_cb(struct nlmsghdr *nlhdr, void *_priv)
 {
 	struct iface_cb_priv *priv = (struct iface_cb_priv *)_priv;
-	struct nlattr *nla;
+	struct nlattr *nla, *name = NULL, *ssid = NULL;
 	int n, type;
 	struct nl80211_iface iface, *p;
 
@@ -98,9 +110,9 @@ static int iface_cb(struct nlmsghdr *nlhdr, void *_priv)
 		if (nla->nla_type == NL80211_ATTR_IFINDEX) {
 			iface.idx = *(uint32_t *)NLA_DATA(nla);
 		} else if (nla->nla_type == NL80211_ATTR_IFNAME) {
-			iface.name = strdup(NLA_DATA(nla));
+			name = nla;
 		} else if (nla->nla_type == NL80211_ATTR_SSID) {
-			iface.ssid = strdup(NLA_DATA(nla));
+			ssid = nla;
 		} else if (nla->nla_type == NL80211_ATTR_WIPHY) {
 			iface.wiphy = *(uint32_t *)NLA_DATA(nla);
 		} else if (nla->nla_type == NL80211_ATTR_IFTYPE) {
@@ -120,21 +132,39 @@ static int iface_cb(struct nlmsghdr *nlhdr, void *_priv)
 		}
 	}
 
-	if (priv->idx >= 0 && priv->idx != iface.idx) {
-		free(iface.name);
-		free(iface.ssid);
-	} else {
-		p = malloc(sizeof(*p));
-		if (!p) {
-			priv->err = 1;
-			nl80211_iface_free(&iface);
-		} else {
-			memcpy(p, &iface, sizeof(iface));
-			p->pnext = priv->iface;
-			priv->iface = p;
-		}
+	if (priv->idx >= 0 && priv->idx != iface.idx)
+		return 0;
+
+	/* Strings are copied only for ifaces we return */
+	if (name) {
+		iface.name = str_dup(priv->arena, NLA_DATA(name),
+				     name->nla_len - NLA_HDRLEN);
+		if (!iface.name)
+			goto err;
+	}
+	if (ssid) {
+		/* SSID isn't a C string, it's up to 32 bytes */
+		iface.ssid = str_dup(priv->arena, NLA_DATA(ssid),
+				     ssid->nla_len - NLA_HDRLEN);
+		if (!iface.ssid)
+			goto err;
 	}
 
+	p = priv->arena ? nl_arena_alloc(priv->arena, sizeof(*p))
+		: malloc(sizeof(*p));
+	if (!p)
+		goto err;
+
+	memcpy(p, &iface, sizeof(iface));
+	p->pnext = priv->iface;
+	priv->iface = p;
+
+	return 0;
+
+err:
+	priv->err = 1;
+	if (!priv->arena)
+		nl80211_iface_free(&iface);
 	return 0;
 }
 
@@ -156,13 +186,15 @@ struct nl80211_iface *nl80211_iface(int iface_idx, int *err)
 		return NULL;
 
 	priv.iface = NULL;
+	priv.arena = arena;
 	priv.err = 0;
 	priv.idx = iface_idx;
 	if (nl_recv_msg(&nlsock, nl80211_id, iface_cb, &priv))
 		return NULL;
 
 	if (priv.err) {
-		nl80211_iface_free(priv.iface);
+		if (!priv.arena)
+			nl80211_iface_free(priv.iface);
 		return NULL;
 	}
 
@@ -195,6 +227,7 @@ struct nl80211_iface *nl80211_create_iface(int wiphy,
 		return NULL;
 
 	priv.iface = NULL;
+	priv.arena = NULL;
 	priv.err = 0;
 	priv.idx = -1;
 	if (nl_recv_msg(&nlsock, nl80211_id, iface_cb, &priv))
@@ -26,6 +26,13 @@ void nl80211_iface_free(struct nl80211_iface *iface);
 
 struct nl80211_iface *nl80211_iface(int iface_idx, int *err);
 
+/*
+ * Allocate results of nl80211_iface() from @arena (see nlcore.h), free
+ * them with the arena, not nl80211_iface_free(). NULL -- malloc().
+ */
+struct nl_arena;
+void nl80211_set_arena(struct nl_arena *arena);
+
 struct nl80211_iface *nl80211_create_iface(int wiphy, const char *name,
 					   int type);
 
@@ -7,12 +7,29 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <net/if.h>
 #include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "nlcore.h"
 
+struct nl_req {
+	unsigned seq;
+	int flags; /* nlmsg_flags of the request */
+	int err; /* The first error, reported when request is completed */
+	int (*cb)(struct nlmsghdr *, void *);
+	void (*done)(int, void *);
+	void *priv;
+	char *msg; /* Copy of the dump request waiting for the running dump */
+	int len;
+	struct nl_req *pnext;
+};
+
+static void nl_fail_reqs(struct nl_sock *nlsock, int err);
+
 static int nlog_dbg;
 
 void nlog(int priority, const char *frmt, ...)
@@ -37,7 +54,7 @@ int nl_open(struct nl_sock *nlsock, int service)
 	if (getenv("LIBNEL_DEBUG"))
 		nlog_dbg = 1;
 
-	if (nlsock->pid > 0)
+	if (NL_IS_OPEN(nlsock))
 		nl_close(nlsock);
 
 	nlsock->sock = socket(AF_NETLINK, SOCK_RAW, service);
@@ -56,6 +73,21 @@ int nl_open(struct nl_sock *nlsock, int service)
 		return -1;
 	}
 
+	/*
+	 * With strict checking (since Linux 4.20) the kernel validates
+	 * headers of dump requests and filters dumps by their fields
+	 * and attributes. Older kernels don't know this option.
+	 */
+	n = 1;
+	nlsock->strict_chk = !setsockopt(nlsock->sock, SOL_NETLINK,
+		NETLINK_GET_STRICT_CHK, &n, sizeof(n));
+	if (!nlsock->strict_chk)
+		DEBUG("kernel doesn't support strict checking");
+
+	/* Don't echo the whole request in error ACKs */
+	n = 1;
+	setsockopt(nlsock->sock, SOL_NETLINK, NETLINK_CAP_ACK, &n, sizeof(n));
+
 	n = sizeof(sa);
 	getsockname(nlsock->sock, (struct sockaddr *)&sa, &n);
 	nlsock->pid = sa.nl_pid;
@@ -67,14 +99,20 @@ int nl_open(struct nl_sock *nlsock, int service)
 
 void nl_close(struct nl_sock *nlsock)
 {
-	if (nlsock->pid <= 0)
+	if (!NL_IS_OPEN(nlsock))
 		return;
 
+	nl_fail_reqs(nlsock, -ECANCELED);
+
 	close(nlsock->sock);
+	free(nlsock->rbuf);
+	nlsock->rbuf = NULL;
+	nlsock->rbuf_size = 0;
 	nlsock->sock = -1;
-	nlsock->pid = -1;
+	nlsock->pid = 0;
 	nlsock->seq = 0;
 	nlsock->service = -1;
+	nlsock->strict_chk = 0;
 }
 
 char *nlmsg_put_hdr(char *buf, int type, int flags)
@@ -90,57 +128,153 @@ char *nlmsg_put_hdr(char *buf, int type, int flags)
 	return buf + NLMSG_HDRLEN;
 }
 
+static int nl_rbuf_grow(struct nl_sock *nlsock, int size)
+{
+	char *p;
+
+	/* Round up to the page size */
+	size = (size + 4095) & ~4095;
+
+	p = realloc(nlsock->rbuf, size);
+	if (!p) {
+		ERRNO("failed to alloc %d bytes recv buffer", size);
+		return -1;
+	}
+	DEBUG("recv buffer: %d -> %d bytes", nlsock->rbuf_size, size);
+	nlsock->rbuf = p;
+	nlsock->rbuf_size = size;
+
+	return 0;
+}
+
+/*
+ * Receive one datagram into the socket receive buffer, return its length.
+ *
+ * With MSG_PEEK in @flags the datagram is peeked first with MSG_TRUNC to
+ * get its real length: if it doesn't fit, the buffer grows, then the
+ * datagram is dequeued without copying it again. That's two syscalls, so
+ * it's only for datagrams of unknown size: notifications and the first
+ * reply to a request. Without MSG_PEEK the datagram is received at once,
+ * the caller must know it fits (see nl_recv_msg()). If it's truncated
+ * anyway, the buffer grows for the next time and EMSGSIZE is returned:
+ * the datagram is lost.
+ */
+static int nl_recv(struct nl_sock *nlsock, int flags)
+{
+	int n, peek = flags & MSG_PEEK;
+	struct pollfd pfd;
+
+	flags &= ~MSG_PEEK;
+
+	if (!nlsock->rbuf && nl_rbuf_grow(nlsock, NL_RBUF_SIZE))
+		return -1;
+
+	while (1) {
+		n = recv(nlsock->sock, nlsock->rbuf, nlsock->rbuf_size,
+			 flags | MSG_TRUNC | (peek ? MSG_PEEK : 0));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Socket is O_NONBLOCK, but caller wants to wait */
+			if (errno == EAGAIN && !(flags & MSG_DONTWAIT)) {
+				pfd.fd = nlsock->sock;
+				pfd.events = POLLIN;
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return -1;
+		}
+
+		if (n <= nlsock->rbuf_size)
+			break;
+
+		if (!peek) {
+			ERROR("datagram of %d bytes is truncated", n);
+			nl_rbuf_grow(nlsock, n);
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		if (nl_rbuf_grow(nlsock, n))
+			return -1;
+	}
+
+	while (peek && recv(nlsock->sock, NULL, 0,
+			    MSG_TRUNC | MSG_DONTWAIT) < 0) {
+		if (errno != EINTR) {
+			ERRNO("failed to dequeue datagram");
+			return -1;
+		}
+	}
+
+	DEBUG("recv %d bytes", n);
+
+	return n;
+}
+
+/*
+ * Messages with a stale seq are leftovers of a request we stopped to read
+ * (e.g. the rest of an aborted dump): skip them, the socket stays usable.
+ */
 int nl_wait_ack(struct nl_sock *nlsock)
 {
-	struct sockaddr_nl sa;
 	int n;
-	char buf[128];
-	struct nlmsghdr *nlhdr, *nlhdr2;
+	struct nlmsghdr *nlhdr;
 	struct nlmsgerr *errmsg;
 
 	while (1) {
-		n = sizeof(sa);
-		n = recvfrom(nlsock->sock, buf, sizeof(buf), 0, (struct sockaddr *)&sa, &n);
+		n = nl_recv(nlsock, 0);
 		if (n < 0) {
-			if (errno == EINTR || errno == EAGAIN)
-				continue;
 			ERRNO("failed to recv");
-			goto err;
+			return -1;
 		}
 
-		break;
-	}
-
-	nlhdr = (struct nlmsghdr *)buf;
+		for (nlhdr = (struct nlmsghdr *)nlsock->rbuf; NLMSG_OK(nlhdr, n);
+		     nlhdr = NLMSG_NEXT(nlhdr, n)) {
+			if (nlhdr->nlmsg_seq != nlsock->seq
+			    || nlhdr->nlmsg_type != NLMSG_ERROR) {
+				DEBUG("skip unexpected msg: type=0x%02x, seq=%u",
+				      nlhdr->nlmsg_type, nlhdr->nlmsg_seq);
+				continue;
+			}
 
-	if (!NLMSG_OK(nlhdr, n)) {
-		ERROR("invalid netlink header?");
-		goto err;
+			errmsg = NLMSG_DATA(nlhdr);
+			DEBUG("error msg with code (errno)=%d (%s)", -errmsg->error,
+			      strerror(-errmsg->error));
+			return errmsg->error;
+		}
 	}
+}
 
-	/*
-	 * NOTE: I don't know why pid is copied from the request (and not 0, like we
-	 * expect to get from kernel).
-	 */
-	if (nlhdr->nlmsg_seq != nlsock->seq || nlhdr->nlmsg_type != NLMSG_ERROR) {
-		ERROR("unexpected msg");
-		goto err;
+int nl_set_rcvbuf(struct nl_sock *nlsock, int size)
+{
+	/* SO_RCVBUFFORCE ignores net.core.rmem_max, but needs CAP_NET_ADMIN */
+	if (!setsockopt(nlsock->sock, SOL_SOCKET, SO_RCVBUFFORCE,
+			&size, sizeof(size)))
+		return 0;
+
+	if (setsockopt(nlsock->sock, SOL_SOCKET, SO_RCVBUF,
+		       &size, sizeof(size))) {
+		ERRNO("failed to set recv buffer size %d", size);
+		return -1;
 	}
 
-	nlhdr2 = NLMSG_NEXT(nlhdr, n);
-	if (NLMSG_OK(nlhdr2, n)) {
-		ERROR("we don't expect anything after ack");
-		goto err;
+	DEBUG("recv buffer size is limited by net.core.rmem_max");
+
+	return 0;
+}
+
+int nl_add_membership(struct nl_sock *nlsock, int group)
+{
+	if (setsockopt(nlsock->sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+		       &group, sizeof(group))) {
+		ERRNO("failed to join multicast group %d", group);
+		return -1;
 	}
 
-	errmsg = NLMSG_DATA(nlhdr);
-	DEBUG("error msg with code (errno)=%d (%s)", -errmsg->error,
-		strerror(-errmsg->error));
-	return errmsg->error;
+	DEBUG("joined multicast group %d", group);
 
-err:
-	nl_open(nlsock, nlsock->service);
-	return -1;
+	return 0;
 }
 
 int nl_send_msg(struct nl_sock *nlsock, char *buf, int len)
@@ -169,57 +303,587 @@ int nl_send_msg(struct nl_sock *nlsock, char *buf, int len)
 	return 0;
 }
 
+/*
+ * The kernel allocates dump datagrams by the biggest recv buffer we used,
+ * max 32KiB (NL_RBUF_SIZE, our buffer is never smaller), or by the biggest
+ * possible message of the dump (min_dump_alloc), whichever is more. Only
+ * link dumps set the latter: with many VFs a link message is bigger than
+ * 32KiB. So their parts, and parts of a dump that already got a datagram
+ * bigger than 32KiB, are peeked to be sized; others are received at once.
+ */
+static int nl_dump_may_grow(struct nl_sock *nlsock, int type, int n)
+{
+	return n > NL_RBUF_SIZE
+		|| nlsock->service == NETLINK_ROUTE && type == RTM_NEWLINK;
+}
+
+/*
+ * If @cb fails, the rest of the reply is read and dropped, so the next
+ * request doesn't get it.
+ */
 int nl_recv_msg(struct nl_sock *nlsock, int type, int (*cb)(struct nlmsghdr *, void *),
 		void *cb_priv)
 {
-	struct sockaddr_nl sa;
-	int n;
-	char buf[4096];
+	int n, failed = 0, started = 0, big = 0;
 	struct nlmsghdr *nlhdr;
 	struct nlmsgerr *errmsg;
 
 	while (1) {
-		n = sizeof(sa);
-		n = recvfrom(nlsock->sock, buf, sizeof(buf), 0, (struct sockaddr *)&sa, &n);
+		/* A reply can be one big message: peek until it starts */
+		n = nl_recv(nlsock, !started || big ? MSG_PEEK : 0);
 		if (n < 0) {
-			if (errno == EINTR || errno == EAGAIN)
-				continue;
 			ERRNO("failed to recv");
-			goto err;
+			return -1;
 		}
+		if (nl_dump_may_grow(nlsock, type, n))
+			big = 1;
 
-		DEBUG("recv %d bytes", n);
-
-		for (nlhdr = (struct nlmsghdr *)buf; NLMSG_OK(nlhdr, n); nlhdr = NLMSG_NEXT(nlhdr, n)) {
+		for (nlhdr = (struct nlmsghdr *)nlsock->rbuf; NLMSG_OK(nlhdr, n); nlhdr = NLMSG_NEXT(nlhdr, n)) {
 			DEBUG("get new msg: len=%d, type=0x%02x", nlhdr->nlmsg_len, nlhdr->nlmsg_type);
 
+			if (nlhdr->nlmsg_seq != nlsock->seq) {
+				DEBUG("skip msg with stale seq=%u", nlhdr->nlmsg_seq);
+				continue;
+			}
+			started = 1;
+
 			if (nlhdr->nlmsg_type == NLMSG_ERROR) {
 				errmsg = NLMSG_DATA(nlhdr);
 				DEBUG("err msg: error=%d", errmsg->error);
+				if (errmsg->error)
+					errno = -errmsg->error;
 				return -1;
 			}
 
 			if (nlhdr->nlmsg_type == NLMSG_DONE) {
 				DEBUG("done msg");
-				return cb(NULL, cb_priv);
+				return failed ? -1 : cb(NULL, cb_priv);
 			}
 
-			if (nlhdr->nlmsg_seq != nlsock->seq || nlhdr->nlmsg_type != type) {
-				ERROR("unexpected msg");
-				goto err;
+			if (nlhdr->nlmsg_type != type) {
+				ERROR("unexpected msg type 0x%02x", nlhdr->nlmsg_type);
+				failed = 1;
 			}
 
-			if (cb(nlhdr, cb_priv))
-				goto err;
+			if (!failed && cb(nlhdr, cb_priv))
+				failed = 1;
 
 			if (!(nlhdr->nlmsg_flags & NLM_F_MULTI)) {
 				DEBUG("msg with unset 'multi' flag");
-				return cb(NULL, cb_priv);
+				return failed ? -1 : cb(NULL, cb_priv);
 			}
 		}
 	}
+}
+
+/*
+ * Read all pending notifications (multicast messages) without blocking.
+ * Return 0 when there is nothing more to read, -1 on error. If errno is
+ * ENOBUFS, the socket receive queue was overrun and some notifications
+ * were lost, so the caller has to resync its state.
+ */
+int nl_recv_notify(struct nl_sock *nlsock, int (*cb)(struct nlmsghdr *, void *),
+		   void *cb_priv)
+{
+	int n;
+	struct nlmsghdr *nlhdr;
+
+	while (1) {
+		n = nl_recv(nlsock, MSG_DONTWAIT | MSG_PEEK);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno != ENOBUFS)
+				ERRNO("failed to recv");
+			return -1;
+		}
+
+		for (nlhdr = (struct nlmsghdr *)nlsock->rbuf; NLMSG_OK(nlhdr, n); nlhdr = NLMSG_NEXT(nlhdr, n)) {
+			if (nlhdr->nlmsg_type < NLMSG_MIN_TYPE)
+				continue;
+
+			if (cb(nlhdr, cb_priv))
+				return -1;
+		}
+	}
+}
+
+void nl_batch_init(struct nl_batch *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+void nl_batch_reset(struct nl_batch *b)
+{
+	b->len = 0;
+	b->n = 0;
+}
+
+void nl_batch_free(struct nl_batch *b)
+{
+	free(b->buf);
+	nl_batch_init(b);
+}
+
+struct nl_arena_chunk {
+	struct nl_arena_chunk *pnext; /* Older chunk */
+	int size, used;
+	char data[] __attribute__((aligned(16)));
+};
+
+#define NL_ARENA_ALIGN(n) (((n) + 15) & ~15)
+
+void nl_arena_init(struct nl_arena *a, int chunk_size)
+{
+	a->chunk = NULL;
+	a->chunk_size = chunk_size > 0 ? chunk_size : NL_ARENA_CHUNK_SIZE;
+}
+
+void *nl_arena_alloc(struct nl_arena *a, int size)
+{
+	struct nl_arena_chunk *c = a->chunk;
+	int n;
+	void *p;
+
+	size = NL_ARENA_ALIGN(size);
+
+	if (!c || c->used + size > c->size) {
+		/* Big objects get a chunk of their own */
+		n = size > a->chunk_size ? size : a->chunk_size;
+		c = malloc(sizeof(*c) + n);
+		if (!c) {
+			ERRNO("failed to alloc %d bytes arena chunk", n);
+			return NULL;
+		}
+		c->size = n;
+		c->used = 0;
+		if (a->chunk && size > a->chunk_size) {
+			/* It's full, the current one may still have room */
+			c->used = size;
+			c->pnext = a->chunk->pnext;
+			a->chunk->pnext = c;
+			return c->data;
+		}
+		c->pnext = a->chunk;
+		a->chunk = c;
+	}
+
+	p = c->data + c->used;
+	c->used += size;
+
+	return p;
+}
+
+char *nl_arena_strndup(struct nl_arena *a, const char *s, int len)
+{
+	char *p;
+
+	len = strnlen(s, len);
+	p = nl_arena_alloc(a, len + 1);
+	if (!p)
+		return NULL;
+	memcpy(p, s, len);
+	p[len] = '\0';
+
+	return p;
+}
+
+char *nl_arena_strdup(struct nl_arena *a, const char *s)
+{
+	return nl_arena_strndup(a, s, strlen(s));
+}
+
+void nl_arena_reset(struct nl_arena *a)
+{
+	struct nl_arena_chunk *c, *next, *keep = NULL;
+
+	if (!a->chunk)
+		return;
+
+	/*
+	 * Keep the oldest chunk of the normal size (big objects' chunks can
+	 * be anywhere in the list) or just the oldest one.
+	 */
+	for (c = a->chunk; c; c = c->pnext) {
+		if (c->size == a->chunk_size || !c->pnext && !keep)
+			keep = c;
+	}
+
+	for (c = a->chunk; c; c = next) {
+		next = c->pnext;
+		if (c != keep)
+			free(c);
+	}
+
+	keep->pnext = NULL;
+	keep->used = 0;
+	a->chunk = keep;
+}
+
+void nl_arena_free(struct nl_arena *a)
+{
+	struct nl_arena_chunk *c;
+
+	while ((c = a->chunk)) {
+		a->chunk = c->pnext;
+		free(c);
+	}
+}
+
+int nl_batch_add(struct nl_batch *b, char *buf, int len)
+{
+	struct nlmsghdr *nlhdr;
+	int n = NLMSG_ALIGN(len), size;
+	char *p;
+
+	if (b->len + n > b->size) {
+		size = b->size ? b->size : 16384;
+		while (size < b->len + n)
+			size *= 2;
+		p = realloc(b->buf, size);
+		if (!p) {
+			ERRNO("failed to alloc batch buffer");
+			return -1;
+		}
+		b->buf = p;
+		b->size = size;
+	}
+
+	nlhdr = (struct nlmsghdr *)(b->buf + b->len);
+	memcpy(nlhdr, buf, len);
+	memset((char *)nlhdr + len, 0, n - len);
+	nlhdr->nlmsg_len = len;
+	nlhdr->nlmsg_flags |= NLM_F_ACK; /* We match results by ACKs */
+	b->len += n;
+
+	return b->n++;
+}
+
+/*
+ * Wait ACKs for @cnt messages with sequence numbers starting from @seq,
+ * add number of failed messages to @nerr. If ACKs can't be received, the
+ * ones already queued are drained, messages without ACK get -errno and
+ * -1 is returned: results of later messages would be unknown too.
+ */
+static int nl_batch_wait_acks(struct nl_sock *nlsock, unsigned seq, int cnt,
+			      int *errs, int *nerr)
+{
+	int n, i, acked = 0, err = 0;
+	struct nlmsghdr *nlhdr;
+	struct nlmsgerr *errmsg;
+
+	/* Not acked yet: results are 0 or -errno */
+	for (i = 0; errs && i < cnt; i++)
+		errs[i] = 1;
+
+	while (acked < cnt) {
+		n = nl_recv(nlsock, err ? MSG_DONTWAIT : 0);
+		if (n < 0) {
+			if (err)
+				break;
+			err = errno;
+			ERRNO("failed to recv ACKs");
+			continue;
+		}
+
+		for (nlhdr = (struct nlmsghdr *)nlsock->rbuf; NLMSG_OK(nlhdr, n); nlhdr = NLMSG_NEXT(nlhdr, n)) {
+			i = nlhdr->nlmsg_seq - seq;
+			if (nlhdr->nlmsg_type != NLMSG_ERROR || i < 0 || i >= cnt) {
+				DEBUG("unexpected msg: type=0x%02x, seq=%u",
+				      nlhdr->nlmsg_type, nlhdr->nlmsg_seq);
+				continue;
+			}
+
+			errmsg = NLMSG_DATA(nlhdr);
+			if (errs)
+				errs[i] = errmsg->error;
+			if (errmsg->error) {
+				DEBUG("msg #%d failed: %s", i, strerror(-errmsg->error));
+				(*nerr)++;
+			}
+			acked++;
+		}
+	}
+
+	if (acked == cnt)
+		return 0;
+
+	for (i = 0; errs && i < cnt; i++) {
+		if (errs[i] == 1)
+			errs[i] = -err;
+	}
+	*nerr += cnt - acked;
 
-err:
-	nl_open(nlsock, nlsock->service);
 	return -1;
 }
+
+int nl_batch_send(struct nl_sock *nlsock, struct nl_batch *b, int *errs)
+{
+	struct sockaddr_nl sa;
+	struct iovec iov;
+	struct msghdr msg;
+	struct nlmsghdr *nlhdr;
+	char *p = b->buf, *q, *end = b->buf + b->len;
+	int i = 0, cnt, nerr = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &sa;
+	msg.msg_namelen = sizeof(sa);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	while (p < end) {
+		for (q = p, cnt = 0; q < end && cnt < NL_BATCH_WINDOW; cnt++) {
+			nlhdr = (struct nlmsghdr *)q;
+			nlhdr->nlmsg_pid = nlsock->pid;
+			nlhdr->nlmsg_seq = ++nlsock->seq;
+			q += NLMSG_ALIGN(nlhdr->nlmsg_len);
+		}
+
+		iov.iov_base = p;
+		iov.iov_len = q - p;
+		if (sendmsg(nlsock->sock, &msg, 0) != q - p) {
+			ERRNO("failed to send");
+			break;
+		}
+
+		DEBUG("send %d msgs, %d bytes", cnt, (int)(q - p));
+
+		if (nl_batch_wait_acks(nlsock, nlsock->seq - cnt + 1, cnt,
+				       errs ? errs + i : NULL, &nerr)) {
+			i += cnt;
+			break;
+		}
+
+		i += cnt;
+		p = q;
+	}
+
+	/* The kernel hasn't seen the rest */
+	if (i < b->n) {
+		DEBUG("%d msgs are not sent", b->n - i);
+		nerr += b->n - i;
+		for (; errs && i < b->n; i++)
+			errs[i] = -ECANCELED;
+	}
+
+	return nerr;
+}
+
+int nl_set_nonblock(struct nl_sock *nlsock, int on)
+{
+	int flags;
+
+	flags = fcntl(nlsock->sock, F_GETFL);
+	if (flags < 0 || fcntl(nlsock->sock, F_SETFL,
+		on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK)) {
+		ERRNO("failed to set O_NONBLOCK");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int nl_req_is_dump(struct nl_req *req)
+{
+	return req->flags & NLM_F_DUMP;
+}
+
+static int nl_req_send(struct nl_sock *nlsock, struct nl_req *req, char *buf,
+		       int len)
+{
+	if (nl_send_msg(nlsock, buf, len))
+		return -1;
+
+	req->seq = nlsock->seq;
+
+	return 0;
+}
+
+/*
+ * Unlink the completed request and queue it to @done: callbacks are run
+ * by nl_reqs_done() when nothing points into the receive buffer anymore.
+ */
+static void nl_req_finish(struct nl_sock *nlsock, struct nl_req *req,
+			  int err, struct nl_req **done)
+{
+	struct nl_req **pp;
+
+	for (pp = &nlsock->reqs; *pp != req; pp = &(*pp)->pnext);
+	*pp = req->pnext;
+
+	DEBUG("request seq=%u is completed: %d", req->seq, err);
+
+	req->err = err;
+	req->pnext = NULL;
+	for (pp = done; *pp; pp = &(*pp)->pnext);
+	*pp = req;
+}
+
+/* Callbacks may submit new requests and even close the socket. */
+static void nl_reqs_done(struct nl_req *done)
+{
+	struct nl_req *req;
+
+	while (done) {
+		req = done;
+		done = req->pnext;
+
+		if (req->done)
+			req->done(req->err, req->priv);
+
+		free(req->msg);
+		free(req);
+	}
+}
+
+/* Remove request from the pending list, report its result and free it. */
+static void nl_req_complete(struct nl_sock *nlsock, struct nl_req *req,
+			    int err)
+{
+	struct nl_req *done = NULL;
+
+	nl_req_finish(nlsock, req, err, &done);
+	nl_reqs_done(done);
+}
+
+/* Send the first dump waiting for the completed one. */
+static void nl_req_next_dump(struct nl_sock *nlsock, struct nl_req **done)
+{
+	struct nl_req *req;
+
+	for (req = nlsock->reqs; req && !req->msg; req = req->pnext);
+	if (!req)
+		return;
+
+	if (nl_req_send(nlsock, req, req->msg, req->len)) {
+		nl_req_finish(nlsock, req, -errno, done);
+		return;
+	}
+
+	free(req->msg);
+	req->msg = NULL;
+}
+
+static void nl_fail_reqs(struct nl_sock *nlsock, int err)
+{
+	while (nlsock->reqs)
+		nl_req_complete(nlsock, nlsock->reqs, err);
+}
+
+int nl_submit(struct nl_sock *nlsock, char *buf, int len,
+	      int (*cb)(struct nlmsghdr *, void *),
+	      void (*done)(int, void *), void *priv)
+{
+	struct nlmsghdr *nlhdr = (struct nlmsghdr *)buf;
+	struct nl_req *req, **pp;
+	int dump_running = 0;
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		ERRNO("failed to alloc request");
+		return -1;
+	}
+
+	req->flags = nlhdr->nlmsg_flags;
+	req->cb = cb;
+	req->done = done;
+	req->priv = priv;
+
+	for (pp = &nlsock->reqs; *pp; pp = &(*pp)->pnext) {
+		if (nl_req_is_dump(*pp))
+			dump_running = 1;
+	}
+
+	if (nl_req_is_dump(req) && dump_running) {
+		req->msg = malloc(len);
+		if (!req->msg) {
+			ERRNO("failed to alloc request");
+			free(req);
+			return -1;
+		}
+		memcpy(req->msg, buf, len);
+		req->len = len;
+		DEBUG("dump is delayed: another one is running");
+	} else if (nl_req_send(nlsock, req, buf, len)) {
+		free(req);
+		return -1;
+	}
+
+	*pp = req;
+
+	return 0;
+}
+
+static struct nl_req *nl_req_find(struct nl_sock *nlsock, unsigned seq)
+{
+	struct nl_req *req;
+
+	for (req = nlsock->reqs; req; req = req->pnext) {
+		if (!req->msg && req->seq == seq)
+			return req;
+	}
+
+	return NULL;
+}
+
+int nl_dispatch(struct nl_sock *nlsock)
+{
+	int n, dump, err;
+	struct nlmsghdr *nlhdr;
+	struct nlmsgerr *errmsg;
+	struct nl_req *req, *done;
+
+	while (1) {
+		n = nl_recv(nlsock, MSG_DONTWAIT | MSG_PEEK);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			ERRNO("failed to recv");
+			/* Replies could be lost, so nothing will complete them */
+			nl_fail_reqs(nlsock, -errno);
+			return -1;
+		}
+
+		done = NULL;
+		for (nlhdr = (struct nlmsghdr *)nlsock->rbuf; NLMSG_OK(nlhdr, n); nlhdr = NLMSG_NEXT(nlhdr, n)) {
+			req = nl_req_find(nlsock, nlhdr->nlmsg_seq);
+			if (!req) {
+				DEBUG("unexpected msg: type=0x%02x, seq=%u",
+				      nlhdr->nlmsg_type, nlhdr->nlmsg_seq);
+				continue;
+			}
+
+			dump = nl_req_is_dump(req);
+
+			if (nlhdr->nlmsg_type == NLMSG_ERROR) {
+				errmsg = NLMSG_DATA(nlhdr);
+				err = req->err ? req->err : errmsg->error;
+			} else if (nlhdr->nlmsg_type == NLMSG_DONE) {
+				err = req->err;
+				/* Dump can be finished with an error */
+				if (!err && NLMSG_DATA_LEN(nlhdr) >= sizeof(int))
+					err = *(int *)NLMSG_DATA(nlhdr);
+			} else {
+				if (!req->err && req->cb && req->cb(nlhdr, req->priv))
+					req->err = -ECANCELED;
+				if (nlhdr->nlmsg_flags & NLM_F_MULTI
+				    || req->flags & NLM_F_ACK)
+					continue;
+				err = req->err;
+			}
+
+			nl_req_finish(nlsock, req, err, &done);
+			if (dump)
+				nl_req_next_dump(nlsock, &done);
+		}
+
+		/* The datagram is walked, rbuf may be reallocated or freed now */
+		nl_reqs_done(done);
+		if (!NL_IS_OPEN(nlsock))
+			return 0;
+	}
+}
@@ -6,13 +6,26 @@
 #include <errno.h>
 #include <linux/netlink.h>
 
+struct nl_req;
+
 struct nl_sock {
 	int sock; /* Socket file descriptor */
 	int seq; /* Sequence of sent message */
-	int pid; /* port (kernel sock has port=0) */
+	int pid; /* port (kernel sock has port=0), 0 -- sock isn't opened */
 	int service; /* NETLINK_ROUTE, NETLINK_GENERIC, ... */
+	int strict_chk; /* Kernel validates and filters dump requests */
+	char *rbuf; /* Receive buffer, grows on demand */
+	int rbuf_size;
+	struct nl_req *reqs; /* Pending asynchronous requests */
 };
 
+/*
+ * Default size of the receive buffer. The kernel fills dump datagrams up
+ * to the size of the buffer the user receives into (max 32KiB), so the
+ * bigger buffer -- the fewer recv() calls.
+ */
+#define NL_RBUF_SIZE 32768
+
 int nl_open(struct nl_sock *nlsock, int service);
 void nl_close(struct nl_sock *nlsock);
 
@@ -24,6 +37,93 @@ int nl_send_msg(struct nl_sock *nlsock, char *buf, int len);
 int nl_recv_msg(struct nl_sock *nlsock, int type,
 		int (*cb)(struct nlmsghdr *, void *), void *cb_priv);
 
+/*
+ * Batch of requests: messages are queued into one buffer, sent together
+ * and ACKs are matched to requests by nlmsg_seq, so N requests cost a few
+ * round trips instead of N.
+ */
+struct nl_batch {
+	char *buf;
+	int len, size;
+	int n; /* Number of queued messages */
+};
+
+/*
+ * Max number of messages sent before collecting their ACKs: each ACK
+ * takes space in the socket receive queue and if it overflows, ACKs
+ * are dropped.
+ */
+#define NL_BATCH_WINDOW 128
+
+void nl_batch_init(struct nl_batch *b);
+/* Copy the message into the batch, return its number in the batch. */
+int nl_batch_add(struct nl_batch *b, char *buf, int len);
+/*
+ * Send all messages and wait for all ACKs. Result of the i-th message
+ * (0 or -errno) is stored in @errs[i], @errs can be NULL. Return number
+ * of failed messages. On a socket error sending stops: messages whose
+ * ACKs were lost get -errno of the error, messages that weren't sent --
+ * -ECANCELED, so the caller knows which ones took effect.
+ */
+int nl_batch_send(struct nl_sock *nlsock, struct nl_batch *b, int *errs);
+/* Remove all messages, keep the buffer. */
+void nl_batch_reset(struct nl_batch *b);
+void nl_batch_free(struct nl_batch *b);
+
+/*
+ * Arena: objects are allocated one after another from big chunks and
+ * are freed all at once by nl_arena_free() (or nl_arena_reset(), which
+ * keeps the first chunk for reuse). There is no per-object free.
+ */
+struct nl_arena_chunk;
+
+struct nl_arena {
+	struct nl_arena_chunk *chunk; /* The current one, list of all */
+	int chunk_size;
+};
+
+#define NL_ARENA_CHUNK_SIZE 65536
+
+/* @chunk_size can be 0, then NL_ARENA_CHUNK_SIZE is used. */
+void nl_arena_init(struct nl_arena *a, int chunk_size);
+void *nl_arena_alloc(struct nl_arena *a, int size);
+char *nl_arena_strdup(struct nl_arena *a, const char *s);
+/* Like strndup(): copy at most @len bytes and add '\0'. */
+char *nl_arena_strndup(struct nl_arena *a, const char *s, int len);
+void nl_arena_reset(struct nl_arena *a);
+void nl_arena_free(struct nl_arena *a);
+
+/*
+ * Set the socket receive buffer size. A big buffer makes overruns
+ * (ENOBUFS, lost notifications) rare when lots of events come at once.
+ */
+int nl_set_rcvbuf(struct nl_sock *nlsock, int size);
+/* Join multicast group (e.g. RTNLGRP_LINK) to get notifications. */
+int nl_add_membership(struct nl_sock *nlsock, int group);
+int nl_recv_notify(struct nl_sock *nlsock,
+		   int (*cb)(struct nlmsghdr *, void *), void *cb_priv);
+
+/*
+ * Asynchronous requests: nl_submit() sends a request and returns at once,
+ * replies are read by nl_dispatch() when the socket fd is readable
+ * (e.g. from an epoll loop). @cb is called for every reply message, @done
+ * -- once, when the request is completed, with 0 or -errno. Dumps are
+ * serialized (the kernel runs one dump per socket): a dump submitted
+ * while another one is running is sent when the previous one completes.
+ * @done is called after the received datagram is processed, so it may
+ * submit new requests or close the socket (nl_dispatch() returns then).
+ * Don't mix asynchronous and blocking calls on the same socket.
+ */
+int nl_set_nonblock(struct nl_sock *nlsock, int on);
+int nl_submit(struct nl_sock *nlsock, char *buf, int len,
+	      int (*cb)(struct nlmsghdr *, void *),
+	      void (*done)(int, void *), void *priv);
+/* Return 0 when there is nothing more to read, -1 on socket error. */
+int nl_dispatch(struct nl_sock *nlsock);
+
+/* Only the first socket of the process gets port=pid, others -- negative */
+#define NL_IS_OPEN(nlsock) ((nlsock)->pid != 0)
+
 #define NLMSG_DATA_LEN(nlhdr) ((nlhdr)->nlmsg_len - NLMSG_HDRLEN)
 
 #define ERROR(frmt, ...) nlog(LOG_ERR, "libnel: %s: "frmt, __func__, ##__VA_ARGS__)
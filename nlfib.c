@@ -0,0 +1,771 @@
+/*
+ * FIB mirror: 16-8-8 multibit trie (like DIR-24-8, but with a smaller
+ * first level, so an empty table is 256KiB and not 64MiB).
+ *
+ * tbl16 is indexed by the upper 16 bits of the address. An entry is
+ * either a nexthop or a reference to a group of 256 entries of the next
+ * level, indexed by the next 8 bits of the address. Prefixes are
+ * expanded: /12 fills 16 entries of tbl16, /20 -- 16 entries of a group.
+ * So a lookup is at most 3 dependent memory reads.
+ *
+ * Every entry also keeps the length of the prefix it came from, so
+ * updates know which entries belong to which prefix: a prefix overwrites
+ * entries of shorter (or the same) prefixes. On deletion its entries get
+ * the longest prefix covering it, which is found in the prefix hash.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "nlcore.h"
+#include "nlroute.h"
+#include "nlfib.h"
+
+#define FIB_EXT 0x80000000 /* Reference to a group */
+#define FIB_DEPTH(e) (((e) >> 24) & 0x3f)
+#define FIB_VAL(e) ((e) & 0xffffff) /* Group or nexthop+1 (0 -- no route) */
+#define FIB_ENTRY(depth, val) ((uint32_t)(depth) << 24 | (val))
+#define FIB_MAX_GROUPS (1 << 24)
+
+struct fib_rt {
+	unsigned metric;
+	int nh;
+	struct fib_rt *pnext; /* Sorted by metric, the first one is used */
+};
+
+struct fib_prefix {
+	uint32_t dest; /* Host byte order */
+	int plen;
+	struct fib_rt *rts;
+	struct fib_prefix *pnext;
+};
+
+struct fib_nh {
+	struct nlr_fib_nh nh;
+	int refs; /* Number of routes, 0 -- free */
+	int next; /* Hash chain or free list, -1 -- end */
+};
+
+struct nlr_fib {
+	int table;
+	uint32_t tbl16[1 << 16];
+	uint32_t *tbl8; /* Groups of 256 entries */
+	int n_groups, groups_size;
+	int free_group; /* Free groups are linked by their first entry */
+
+	struct fib_nh *nhs;
+	int n_nhs, nhs_size;
+	int free_nh;
+	int *nh_hash; /* Heads of chains, size is nhs_size */
+
+	struct fib_prefix **prefixes; /* Hash */
+	unsigned prefixes_size, n_prefixes;
+
+	struct nlr_monitor *mon;
+	int stale; /* An update failed, reload on the next sync */
+};
+
+static unsigned fib_hash(uint32_t a, uint32_t b, uint32_t c)
+{
+	unsigned h = 2166136261u; /* FNV-1a of the words */
+
+	h = (h ^ a) * 16777619u;
+	h = (h ^ b) * 16777619u;
+	h = (h ^ c) * 16777619u;
+	return h ^ h >> 15;
+}
+
+/*
+ * Nexthops: routes share them, the trie stores their indexes.
+ */
+static unsigned nh_bucket(struct nlr_fib *fib, struct nlr_fib_nh *nh)
+{
+	return fib_hash(nh->gw, nh->oif, nh->type) & (fib->nhs_size - 1);
+}
+
+static int nh_grow(struct nlr_fib *fib)
+{
+	int size = fib->nhs_size ? fib->nhs_size * 2 : 64, i, h;
+	struct fib_nh *nhs;
+	int *hash;
+
+	nhs = realloc(fib->nhs, size * sizeof(*nhs));
+	if (!nhs) {
+		ERRNO("failed to alloc %d nexthops", size);
+		return -1;
+	}
+	fib->nhs = nhs;
+
+	hash = realloc(fib->nh_hash, size * sizeof(*hash));
+	if (!hash) {
+		ERRNO("failed to alloc nexthop hash");
+		return -1;
+	}
+	fib->nh_hash = hash;
+	fib->nhs_size = size;
+
+	for (i = 0; i < size; i++)
+		hash[i] = -1;
+	for (i = 0; i < fib->n_nhs; i++) {
+		if (!nhs[i].refs)
+			continue;
+		h = nh_bucket(fib, &nhs[i].nh);
+		nhs[i].next = hash[h];
+		hash[h] = i;
+	}
+
+	return 0;
+}
+
+/* Find or add nexthop, take a reference. */
+static int nh_get(struct nlr_fib *fib, struct nlr_route *r)
+{
+	struct nlr_fib_nh nh;
+	int i, h;
+
+	memset(&nh, 0, sizeof(nh));
+	nh.gw = r->gw;
+	nh.oif = r->oif;
+	nh.type = r->type;
+	/* Multipath route: only the first path is mirrored */
+	if (r->n_nhs > 0) {
+		nh.gw = r->nhs[0].gw;
+		nh.oif = r->nhs[0].oif;
+	}
+
+	if (fib->nhs_size) {
+		for (i = fib->nh_hash[nh_bucket(fib, &nh)]; i >= 0;
+		     i = fib->nhs[i].next) {
+			if (!memcmp(&fib->nhs[i].nh, &nh, sizeof(nh))) {
+				fib->nhs[i].refs++;
+				return i;
+			}
+		}
+	}
+
+	if (fib->free_nh >= 0) {
+		i = fib->free_nh;
+		fib->free_nh = fib->nhs[i].next;
+	} else {
+		if (fib->n_nhs == fib->nhs_size && nh_grow(fib))
+			return -1;
+		i = fib->n_nhs++;
+	}
+
+	fib->nhs[i].nh = nh;
+	fib->nhs[i].refs = 1;
+	h = nh_bucket(fib, &nh);
+	fib->nhs[i].next = fib->nh_hash[h];
+	fib->nh_hash[h] = i;
+
+	return i;
+}
+
+static void nh_put(struct nlr_fib *fib, int i)
+{
+	int *p;
+
+	if (--fib->nhs[i].refs)
+		return;
+
+	for (p = &fib->nh_hash[nh_bucket(fib, &fib->nhs[i].nh)]; *p != i;
+	     p = &fib->nhs[*p].next)
+		;
+	*p = fib->nhs[i].next;
+
+	fib->nhs[i].next = fib->free_nh;
+	fib->free_nh = i;
+}
+
+/*
+ * Prefix hash: all routes of the table, the source of truth for the trie.
+ */
+static struct fib_prefix **prefix_find(struct nlr_fib *fib, uint32_t dest,
+				       int plen)
+{
+	struct fib_prefix **pp;
+
+	pp = &fib->prefixes[fib_hash(dest, plen, 0)
+			    & (fib->prefixes_size - 1)];
+	while (*pp && ((*pp)->dest != dest || (*pp)->plen != plen))
+		pp = &(*pp)->pnext;
+	return pp;
+}
+
+static int prefix_grow(struct nlr_fib *fib)
+{
+	unsigned size = fib->prefixes_size ? fib->prefixes_size * 2 : 1024;
+	struct fib_prefix **prefixes, *p, *next;
+	unsigned i, h;
+
+	prefixes = calloc(size, sizeof(*prefixes));
+	if (!prefixes) {
+		ERRNO("failed to alloc prefix hash");
+		return -1;
+	}
+
+	for (i = 0; i < fib->prefixes_size; i++) {
+		for (p = fib->prefixes[i]; p; p = next) {
+			next = p->pnext;
+			h = fib_hash(p->dest, p->plen, 0) & (size - 1);
+			p->pnext = prefixes[h];
+			prefixes[h] = p;
+		}
+	}
+
+	free(fib->prefixes);
+	fib->prefixes = prefixes;
+	fib->prefixes_size = size;
+
+	return 0;
+}
+
+/*
+ * Trie
+ */
+static int group_alloc(struct nlr_fib *fib, uint32_t fill)
+{
+	uint32_t *tbl8;
+	int g, i, size;
+
+	if (fib->free_group >= 0) {
+		g = fib->free_group;
+		fib->free_group = fib->tbl8[g << 8];
+	} else {
+		if (fib->n_groups == fib->groups_size) {
+			size = fib->groups_size ? fib->groups_size * 2 : 64;
+			if (size > FIB_MAX_GROUPS) {
+				ERROR("too many trie groups");
+				return -1;
+			}
+			tbl8 = realloc(fib->tbl8, (size << 8) * sizeof(*tbl8));
+			if (!tbl8) {
+				ERRNO("failed to alloc %d trie groups", size);
+				return -1;
+			}
+			fib->tbl8 = tbl8;
+			fib->groups_size = size;
+		}
+		g = fib->n_groups++;
+	}
+
+	for (i = 0; i < 256; i++)
+		fib->tbl8[(g << 8) + i] = fill;
+
+	return g;
+}
+
+/*
+ * If all entries of the group are the same nexthop of a prefix not longer
+ * than @depth (of the parent level), return 1 and it. A longer prefix
+ * can't be folded: its deletion wouldn't find its entries.
+ */
+static int group_uniform(struct nlr_fib *fib, int g, int depth, uint32_t *e)
+{
+	uint32_t *t = fib->tbl8 + (g << 8);
+	int i;
+
+	if (t[0] & FIB_EXT || FIB_DEPTH(t[0]) > depth)
+		return 0;
+	for (i = 1; i < 256; i++) {
+		if (t[i] != t[0])
+			return 0;
+	}
+
+	*e = t[0];
+	return 1;
+}
+
+static void group_free(struct nlr_fib *fib, int g)
+{
+	fib->tbl8[g << 8] = fib->free_group;
+	fib->free_group = g;
+}
+
+/*
+ * Write @e into @n entries of table @t from @lo: into entries of shorter
+ * prefixes when a prefix is added, into entries of the prefix itself when
+ * it's deleted.
+ */
+static void fib_set(struct nlr_fib *fib, uint32_t *t, int lo, int n,
+		    int plen, uint32_t e, int del)
+{
+	uint32_t ent;
+	int i;
+
+	for (i = lo; i < lo + n; i++) {
+		ent = t[i];
+		if (ent & FIB_EXT)
+			fib_set(fib, fib->tbl8 + (FIB_VAL(ent) << 8), 0, 256,
+				plen, e, del);
+		else if (del ? FIB_DEPTH(ent) == plen && FIB_VAL(ent)
+			 : FIB_DEPTH(ent) <= plen)
+			t[i] = e;
+	}
+}
+
+static int fib_write(struct nlr_fib *fib, uint32_t dest, int plen,
+		     uint32_t e, int del)
+{
+	uint32_t *parent, u;
+	int g, g2, i;
+
+	if (plen <= 16) {
+		fib_set(fib, fib->tbl16, dest >> 16, 1 << (16 - plen),
+			plen, e, del);
+		return 0;
+	}
+
+	parent = &fib->tbl16[dest >> 16];
+	if (!(*parent & FIB_EXT)) {
+		if (del)
+			return 0;
+		g = group_alloc(fib, *parent);
+		if (g < 0)
+			return -1;
+		*parent = FIB_EXT | g;
+	}
+	g = FIB_VAL(*parent);
+
+	if (plen <= 24) {
+		fib_set(fib, fib->tbl8 + (g << 8), (dest >> 8) & 255,
+			1 << (24 - plen), plen, e, del);
+	} else {
+		i = (g << 8) + ((dest >> 8) & 255);
+		if (!(fib->tbl8[i] & FIB_EXT)) {
+			if (del)
+				return 0;
+			/* tbl8 can be moved by realloc() */
+			g2 = group_alloc(fib, fib->tbl8[i]);
+			if (g2 < 0)
+				return -1;
+			fib->tbl8[i] = FIB_EXT | g2;
+		}
+		g2 = FIB_VAL(fib->tbl8[i]);
+
+		fib_set(fib, fib->tbl8 + (g2 << 8), dest & 255,
+			1 << (32 - plen), plen, e, del);
+
+		if (del && group_uniform(fib, g2, 24, &u)) {
+			fib->tbl8[i] = u;
+			group_free(fib, g2);
+		}
+	}
+
+	if (del && group_uniform(fib, g, 16, &u)) {
+		fib->tbl16[dest >> 16] = u;
+		group_free(fib, g);
+	}
+
+	return 0;
+}
+
+/* The longest prefix covering @dest/@plen, its entry or 0 if none. */
+static uint32_t fib_cover(struct nlr_fib *fib, uint32_t dest, int plen)
+{
+	struct fib_prefix *p;
+	uint32_t mask;
+
+	while (plen-- > 0) {
+		mask = plen ? ~0u << (32 - plen) : 0;
+		p = *prefix_find(fib, dest & mask, plen);
+		if (p)
+			return FIB_ENTRY(plen, p->rts->nh + 1);
+	}
+
+	return 0;
+}
+
+static int fib_add(struct nlr_fib *fib, uint32_t dest, struct nlr_route *r)
+{
+	struct fib_prefix **pp, *p;
+	struct fib_rt **rp, *rt;
+	int nh, best;
+
+	if (fib->n_prefixes >= fib->prefixes_size && prefix_grow(fib))
+		return -1;
+
+	nh = nh_get(fib, r);
+	if (nh < 0)
+		return -1;
+
+	pp = prefix_find(fib, dest, r->dest_plen);
+	p = *pp;
+	if (!p) {
+		p = calloc(1, sizeof(*p));
+		if (!p) {
+			ERRNO("failed to alloc fib prefix");
+			nh_put(fib, nh);
+			return -1;
+		}
+		p->dest = dest;
+		p->plen = r->dest_plen;
+		*pp = p;
+		fib->n_prefixes++;
+	}
+
+	best = p->rts ? p->rts->nh : -1;
+
+	for (rp = &p->rts; *rp && (*rp)->metric < (unsigned)r->metrics;
+	     rp = &(*rp)->pnext)
+		;
+	if (*rp && (*rp)->metric == (unsigned)r->metrics) {
+		/* Replaced */
+		rt = *rp;
+		nh_put(fib, rt->nh);
+	} else {
+		rt = malloc(sizeof(*rt));
+		if (!rt) {
+			ERRNO("failed to alloc fib route");
+			nh_put(fib, nh);
+			return -1;
+		}
+		rt->metric = r->metrics;
+		rt->pnext = *rp;
+		*rp = rt;
+	}
+	rt->nh = nh;
+
+	if (p->rts->nh == best)
+		return 0;
+
+	return fib_write(fib, dest, p->plen,
+			 FIB_ENTRY(p->plen, p->rts->nh + 1), 0);
+}
+
+static int fib_del(struct nlr_fib *fib, uint32_t dest, struct nlr_route *r)
+{
+	struct fib_prefix **pp, *p;
+	struct fib_rt **rp, *rt;
+	int best;
+
+	pp = prefix_find(fib, dest, r->dest_plen);
+	p = *pp;
+	if (!p)
+		return 0;
+
+	for (rp = &p->rts; *rp && (*rp)->metric != (unsigned)r->metrics;
+	     rp = &(*rp)->pnext)
+		;
+	if (!*rp)
+		return 0;
+
+	best = p->rts->nh;
+	rt = *rp;
+	*rp = rt->pnext;
+	nh_put(fib, rt->nh);
+	free(rt);
+
+	if (p->rts) {
+		if (p->rts->nh == best)
+			return 0;
+		return fib_write(fib, dest, p->plen,
+				 FIB_ENTRY(p->plen, p->rts->nh + 1), 0);
+	}
+
+	*pp = p->pnext;
+	free(p);
+	fib->n_prefixes--;
+
+	return fib_write(fib, dest, r->dest_plen,
+			 fib_cover(fib, dest, r->dest_plen), 1);
+}
+
+int nlr_fib_update(struct nlr_fib *fib, int deleted, struct nlr_route *r)
+{
+	uint32_t mask, dest;
+
+	if (r->table != fib->table || r->dest_plen < 0 || r->dest_plen > 32)
+		return 0;
+
+	mask = r->dest_plen ? ~0u << (32 - r->dest_plen) : 0;
+	dest = ntohl(r->dest) & mask;
+
+	return deleted ? fib_del(fib, dest, r) : fib_add(fib, dest, r);
+}
+
+static inline uint32_t fib_entry(struct nlr_fib *fib, uint32_t a)
+{
+	uint32_t e;
+
+	e = fib->tbl16[a >> 16];
+	if (e & FIB_EXT) {
+		e = fib->tbl8[(FIB_VAL(e) << 8) + ((a >> 8) & 255)];
+		if (e & FIB_EXT)
+			e = fib->tbl8[(FIB_VAL(e) << 8) + (a & 255)];
+	}
+
+	return e;
+}
+
+const struct nlr_fib_nh *nlr_fib_lookup(struct nlr_fib *fib, in_addr_t addr)
+{
+	uint32_t e = fib_entry(fib, ntohl(addr));
+
+	return FIB_VAL(e) ? &fib->nhs[FIB_VAL(e) - 1].nh : NULL;
+}
+
+static void lookup_batch_scalar(struct nlr_fib *fib, const in_addr_t *addrs,
+				int n, int *out_oif, in_addr_t *out_gw)
+{
+	struct nlr_fib_nh *nh;
+	uint32_t e;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		e = fib_entry(fib, ntohl(addrs[i]));
+		if (FIB_VAL(e)) {
+			nh = &fib->nhs[FIB_VAL(e) - 1].nh;
+			out_oif[i] = nh->oif;
+			out_gw[i] = nh->gw;
+		} else {
+			out_oif[i] = 0;
+			out_gw[i] = 0;
+		}
+	}
+}
+
+#ifdef __x86_64__
+/*
+ * 8 addresses at once: every trie level is one gather, the next levels
+ * are gathered only for lanes that have a group there (masked gather).
+ * SSE4 has no gather, so there is no SSE4 kernel: it would be the scalar
+ * code with extra shuffles.
+ */
+__attribute__((target("avx2")))
+static void lookup_batch_avx2(struct nlr_fib *fib, const in_addr_t *addrs,
+			      int n, int *out_oif, in_addr_t *out_gw)
+{
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+		11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+		11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i val_mask = _mm256_set1_epi32(0xffffff);
+	const __m256i byte_mask = _mm256_set1_epi32(255);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i nh_stride = _mm256_set1_epi32(sizeof(struct fib_nh) / 4);
+	const __m256i zero = _mm256_setzero_si256();
+	const int *tbl16 = (const int *)fib->tbl16;
+	const int *tbl8 = (const int *)fib->tbl8;
+	const int *nh_gw = (const int *)((char *)fib->nhs
+		+ offsetof(struct fib_nh, nh.gw));
+	const int *nh_oif = (const int *)((char *)fib->nhs
+		+ offsetof(struct fib_nh, nh.oif));
+	__m256i a, e, m, idx, v, hit;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_shuffle_epi8(
+			_mm256_loadu_si256((const __m256i *)(addrs + i)), bswap);
+
+		e = _mm256_i32gather_epi32(tbl16, _mm256_srli_epi32(a, 16), 4);
+
+		/* FIB_EXT is the sign bit */
+		m = _mm256_srai_epi32(e, 31);
+		if (!_mm256_testz_si256(m, m)) {
+			idx = _mm256_add_epi32(
+				_mm256_slli_epi32(_mm256_and_si256(e, val_mask), 8),
+				_mm256_and_si256(_mm256_srli_epi32(a, 8),
+						 byte_mask));
+			e = _mm256_mask_i32gather_epi32(e, tbl8, idx, m, 4);
+
+			m = _mm256_srai_epi32(e, 31);
+			if (!_mm256_testz_si256(m, m)) {
+				idx = _mm256_add_epi32(
+					_mm256_slli_epi32(
+						_mm256_and_si256(e, val_mask), 8),
+					_mm256_and_si256(a, byte_mask));
+				e = _mm256_mask_i32gather_epi32(e, tbl8, idx,
+								m, 4);
+			}
+		}
+
+		v = _mm256_and_si256(e, val_mask);
+		hit = _mm256_cmpgt_epi32(v, zero);
+		idx = _mm256_mullo_epi32(_mm256_sub_epi32(v, one), nh_stride);
+
+		_mm256_storeu_si256((__m256i *)(out_gw + i),
+			_mm256_mask_i32gather_epi32(zero, nh_gw, idx, hit, 4));
+		_mm256_storeu_si256((__m256i *)(out_oif + i),
+			_mm256_mask_i32gather_epi32(zero, nh_oif, idx, hit, 4));
+	}
+
+	lookup_batch_scalar(fib, addrs + i, n - i, out_oif + i, out_gw + i);
+}
+#endif
+
+static void (*lookup_batch)(struct nlr_fib *, const in_addr_t *, int,
+			    int *, in_addr_t *);
+
+void nlr_fib_lookup_batch(struct nlr_fib *fib, const in_addr_t *addrs, int n,
+			  int *out_oif, in_addr_t *out_gw)
+{
+	if (!lookup_batch) {
+		lookup_batch = lookup_batch_scalar;
+#ifdef __x86_64__
+		if (__builtin_cpu_supports("avx2")) {
+			DEBUG("AVX2 is supported");
+			lookup_batch = lookup_batch_avx2;
+		}
+#endif
+	}
+
+#ifdef __x86_64__
+	/* Indexes of gathers are signed 32-bit */
+	if (fib->groups_size >= 1 << 23) {
+		lookup_batch_scalar(fib, addrs, n, out_oif, out_gw);
+		return;
+	}
+#endif
+
+	lookup_batch(fib, addrs, n, out_oif, out_gw);
+}
+
+static void fib_flush(struct nlr_fib *fib)
+{
+	struct fib_prefix *p, *next;
+	struct fib_rt *rt;
+	unsigned i;
+
+	for (i = 0; i < fib->prefixes_size; i++) {
+		for (p = fib->prefixes[i]; p; p = next) {
+			next = p->pnext;
+			while ((rt = p->rts)) {
+				p->rts = rt->pnext;
+				free(rt);
+			}
+			free(p);
+		}
+	}
+	free(fib->prefixes);
+	fib->prefixes = NULL;
+	fib->prefixes_size = fib->n_prefixes = 0;
+
+	memset(fib->tbl16, 0, sizeof(fib->tbl16));
+	free(fib->tbl8);
+	fib->tbl8 = NULL;
+	fib->n_groups = fib->groups_size = 0;
+	fib->free_group = -1;
+
+	free(fib->nhs);
+	free(fib->nh_hash);
+	fib->nhs = NULL;
+	fib->nh_hash = NULL;
+	fib->n_nhs = fib->nhs_size = 0;
+	fib->free_nh = -1;
+}
+
+struct fib_load_priv {
+	struct nlr_fib *fib;
+	int err;
+};
+
+static int fib_load_cb(struct nlr_route *r, void *_priv)
+{
+	struct fib_load_priv *priv = (struct fib_load_priv *)_priv;
+
+	/* Stopping the visitor isn't an error for it */
+	if (nlr_fib_update(priv->fib, 0, r)) {
+		priv->err = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fib_load(struct nlr_fib *fib)
+{
+	struct nlr_route filter;
+	struct fib_load_priv priv;
+
+	fib_flush(fib);
+
+	/* All fields unset: -1 and INADDR_NONE */
+	memset(&filter, 0xff, sizeof(filter));
+	filter.nhs = NULL;
+	filter.n_nhs = 0;
+	filter.pnext = NULL;
+	filter.table = fib->table;
+
+	priv.fib = fib;
+	priv.err = 0;
+
+	if (nlr_foreach_route(&filter, fib_load_cb, &priv) || priv.err) {
+		fib_flush(fib);
+		fib->stale = 1;
+		return -1;
+	}
+	fib->stale = 0;
+
+	DEBUG("table %d: %u prefixes, %d groups, %d nexthops", fib->table,
+	      fib->n_prefixes, fib->n_groups, fib->n_nhs);
+
+	return 0;
+}
+
+static void fib_mon_route(int deleted, struct nlr_route *r, void *fib)
+{
+	if (nlr_fib_update(fib, deleted, r)) {
+		ERROR("failed to update fib, it will be reloaded");
+		((struct nlr_fib *)fib)->stale = 1;
+	}
+}
+
+struct nlr_fib *nlr_fib_open(int table)
+{
+	static const struct nlr_monitor_ops ops = {
+		.route = fib_mon_route,
+	};
+	struct nlr_fib *fib;
+
+	fib = calloc(1, sizeof(*fib));
+	if (!fib) {
+		ERRNO("failed to alloc fib");
+		return NULL;
+	}
+	fib->table = table;
+	fib->free_group = -1;
+	fib->free_nh = -1;
+
+	/* Subscribe before the dump, so we don't miss any changes */
+	fib->mon = nlr_monitor_open(NLR_MON_ROUTE, &ops, fib);
+	if (!fib->mon || fib_load(fib)) {
+		nlr_fib_close(fib);
+		return NULL;
+	}
+
+	return fib;
+}
+
+void nlr_fib_close(struct nlr_fib *fib)
+{
+	if (!fib)
+		return;
+	nlr_monitor_close(fib->mon);
+	fib_flush(fib);
+	free(fib);
+}
+
+int nlr_fib_fd(struct nlr_fib *fib)
+{
+	return nlr_monitor_fd(fib->mon);
+}
+
+int nlr_fib_sync(struct nlr_fib *fib)
+{
+	if (nlr_monitor_dispatch(fib->mon)) {
+		if (errno != ENOBUFS)
+			return -1;
+		DEBUG("route notifications were lost, reload table %d",
+		      fib->table);
+	} else if (!fib->stale) {
+		return 0;
+	}
+
+	return fib_load(fib);
+}
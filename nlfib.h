@@ -0,0 +1,51 @@
+#ifndef _NLFIB_H
+#define _NLFIB_H
+
+#include "nlroute.h"
+
+/*
+ * FIB mirror: a copy of one kernel routing table in the userland with
+ * longest prefix match lookups without syscalls. It's loaded by a dump
+ * and then kept up to date by route notifications.
+ */
+
+struct nlr_fib_nh {
+	in_addr_t gw; /* 0 -- directly connected */
+	int oif;
+	int type; /* RTN_UNICAST, RTN_LOCAL, RTN_BLACKHOLE, ... */
+};
+
+struct nlr_fib;
+
+/* Mirror routing table @table (e.g. RT_TABLE_MAIN). */
+struct nlr_fib *nlr_fib_open(int table);
+void nlr_fib_close(struct nlr_fib *fib);
+
+/*
+ * Add this fd to your poll set and call nlr_fib_sync() when it's
+ * readable. If notifications were lost, the table is reloaded.
+ */
+int nlr_fib_fd(struct nlr_fib *fib);
+int nlr_fib_sync(struct nlr_fib *fib);
+
+/*
+ * Apply a route change yourself, e.g. from your own nlr_monitor.
+ * Routes of other tables are ignored.
+ */
+int nlr_fib_update(struct nlr_fib *fib, int deleted, struct nlr_route *route);
+
+/*
+ * Longest prefix match. Return nexthop of the route to @addr or NULL if
+ * there is no route. The nexthop is valid until the next update.
+ */
+const struct nlr_fib_nh *nlr_fib_lookup(struct nlr_fib *fib, in_addr_t addr);
+
+/*
+ * Look up @n addresses at once: output interface and gateway of the i-th
+ * one are stored in @out_oif[i] and @out_gw[i], both are 0 if there is
+ * no route. Uses AVX2 if the CPU has it.
+ */
+void nlr_fib_lookup_batch(struct nlr_fib *fib, const in_addr_t *addrs, int n,
+			  int *out_oif, in_addr_t *out_gw);
+
+#endif
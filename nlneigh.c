@@ -0,0 +1,260 @@
+/*
+ * Neighbour cache: entries are in a chained hash by (iface, addr), the
+ * number of buckets is doubled when there are more entries than buckets.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "nlcore.h"
+#include "nlroute.h"
+#include "nlneigh.h"
+
+struct neigh_ent {
+	struct nlr_neigh neigh;
+	struct neigh_ent *next;
+};
+
+struct nlr_neigh_cache {
+	struct neigh_ent **buckets;
+	unsigned size, n; /* Number of buckets (power of 2) and entries */
+	struct nlr_monitor *mon;
+	int stale; /* An update failed, reload on the next sync */
+};
+
+static unsigned neigh_hash(int iface_idx, in_addr_t addr)
+{
+	unsigned h = 2166136261u; /* FNV-1a of the words */
+
+	h = (h ^ iface_idx) * 16777619u;
+	h = (h ^ addr) * 16777619u;
+	return h ^ h >> 15;
+}
+
+static struct neigh_ent **neigh_find(struct nlr_neigh_cache *c,
+				     int iface_idx, in_addr_t addr)
+{
+	struct neigh_ent **pp;
+
+	pp = &c->buckets[neigh_hash(iface_idx, addr) & (c->size - 1)];
+	while (*pp && ((*pp)->neigh.iface_idx != iface_idx
+		       || (*pp)->neigh.addr != addr))
+		pp = &(*pp)->next;
+	return pp;
+}
+
+static int neigh_grow(struct nlr_neigh_cache *c)
+{
+	unsigned size = c->size ? c->size * 2 : 1024, i, h;
+	struct neigh_ent **buckets, *e, *next;
+
+	buckets = calloc(size, sizeof(*buckets));
+	if (!buckets) {
+		ERRNO("failed to alloc neighbour hash");
+		return -1;
+	}
+
+	for (i = 0; i < c->size; i++) {
+		for (e = c->buckets[i]; e; e = next) {
+			next = e->next;
+			h = neigh_hash(e->neigh.iface_idx, e->neigh.addr)
+				& (size - 1);
+			e->next = buckets[h];
+			buckets[h] = e;
+		}
+	}
+
+	free(c->buckets);
+	c->buckets = buckets;
+	c->size = size;
+
+	return 0;
+}
+
+static int neigh_update(struct nlr_neigh_cache *c, int deleted,
+			struct nlr_neigh *neigh)
+{
+	struct neigh_ent **pp, *e;
+
+	if (!deleted && c->n >= c->size && neigh_grow(c))
+		return -1;
+
+	pp = neigh_find(c, neigh->iface_idx, neigh->addr);
+	e = *pp;
+
+	if (deleted) {
+		if (e) {
+			*pp = e->next;
+			free(e);
+			c->n--;
+		}
+		return 0;
+	}
+
+	if (!e) {
+		e = malloc(sizeof(*e));
+		if (!e) {
+			ERRNO("failed to alloc neighbour");
+			return -1;
+		}
+		e->next = NULL;
+		*pp = e;
+		c->n++;
+	}
+
+	e->neigh = *neigh;
+	e->neigh.pnext = NULL;
+
+	return 0;
+}
+
+static void neigh_flush(struct nlr_neigh_cache *c)
+{
+	struct neigh_ent *e, *next;
+	unsigned i;
+
+	for (i = 0; i < c->size; i++) {
+		for (e = c->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+		c->buckets[i] = NULL;
+	}
+	c->n = 0;
+}
+
+struct neigh_load_priv {
+	struct nlr_neigh_cache *c;
+	int err;
+};
+
+static int neigh_load_cb(struct nlr_neigh *neigh, void *_priv)
+{
+	struct neigh_load_priv *priv = (struct neigh_load_priv *)_priv;
+
+	/* Stopping the visitor isn't an error for it */
+	if (neigh_update(priv->c, 0, neigh)) {
+		priv->err = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int neigh_load(struct nlr_neigh_cache *c)
+{
+	struct neigh_load_priv priv;
+
+	neigh_flush(c);
+
+	priv.c = c;
+	priv.err = 0;
+
+	if (nlr_foreach_neigh(-1, neigh_load_cb, &priv) || priv.err) {
+		neigh_flush(c);
+		c->stale = 1;
+		return -1;
+	}
+	c->stale = 0;
+
+	DEBUG("%u neighbours", c->n);
+
+	return 0;
+}
+
+static void neigh_mon(int deleted, struct nlr_neigh *neigh, void *c)
+{
+	if (neigh_update(c, deleted, neigh)) {
+		ERROR("failed to update neighbour cache, it will be reloaded");
+		((struct nlr_neigh_cache *)c)->stale = 1;
+	}
+}
+
+struct nlr_neigh_cache *nlr_neigh_cache_open(void)
+{
+	static const struct nlr_monitor_ops ops = {
+		.neigh = neigh_mon,
+	};
+	struct nlr_neigh_cache *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		ERRNO("failed to alloc neighbour cache");
+		return NULL;
+	}
+
+	if (neigh_grow(c)) {
+		free(c);
+		return NULL;
+	}
+
+	/* Subscribe before the dump, so we don't miss any changes */
+	c->mon = nlr_monitor_open(NLR_MON_NEIGH, &ops, c);
+	if (!c->mon || neigh_load(c)) {
+		nlr_neigh_cache_close(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+void nlr_neigh_cache_close(struct nlr_neigh_cache *c)
+{
+	if (!c)
+		return;
+	nlr_monitor_close(c->mon);
+	neigh_flush(c);
+	free(c->buckets);
+	free(c);
+}
+
+int nlr_neigh_cache_fd(struct nlr_neigh_cache *c)
+{
+	return nlr_monitor_fd(c->mon);
+}
+
+int nlr_neigh_cache_sync(struct nlr_neigh_cache *c)
+{
+	if (nlr_monitor_dispatch(c->mon)) {
+		if (errno != ENOBUFS)
+			return -1;
+		DEBUG("neighbour notifications were lost, reload");
+	} else if (!c->stale) {
+		return 0;
+	}
+
+	return neigh_load(c);
+}
+
+const struct nlr_neigh *nlr_neigh_cache_lookup(struct nlr_neigh_cache *c,
+					       int iface_idx, in_addr_t addr)
+{
+	struct neigh_ent *e = *neigh_find(c, iface_idx, addr);
+
+	return e ? &e->neigh : NULL;
+}
+
+int nlr_neigh_cache_count(struct nlr_neigh_cache *c)
+{
+	return c->n;
+}
+
+int nlr_neigh_cache_foreach(struct nlr_neigh_cache *c,
+			    int (*cb)(const struct nlr_neigh *, void *),
+			    void *priv)
+{
+	struct neigh_ent *e;
+	unsigned i;
+
+	for (i = 0; i < c->size; i++) {
+		for (e = c->buckets[i]; e; e = e->next) {
+			if (cb(&e->neigh, priv))
+				return 0;
+		}
+	}
+
+	return 0;
+}
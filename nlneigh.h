@@ -0,0 +1,32 @@
+#ifndef _NLNEIGH_H
+#define _NLNEIGH_H
+
+#include "nlroute.h"
+
+/*
+ * Neighbour cache: a copy of the ARP table indexed by (iface, addr). It's
+ * loaded by a dump and then kept up to date by neighbour notifications.
+ */
+
+struct nlr_neigh_cache;
+
+struct nlr_neigh_cache *nlr_neigh_cache_open(void);
+void nlr_neigh_cache_close(struct nlr_neigh_cache *c);
+
+/*
+ * Add this fd to your poll set and call nlr_neigh_cache_sync() when it's
+ * readable. If notifications were lost, the cache is reloaded.
+ */
+int nlr_neigh_cache_fd(struct nlr_neigh_cache *c);
+int nlr_neigh_cache_sync(struct nlr_neigh_cache *c);
+
+/* Return the entry or NULL. It's valid until the next sync. */
+const struct nlr_neigh *nlr_neigh_cache_lookup(struct nlr_neigh_cache *c,
+					       int iface_idx, in_addr_t addr);
+int nlr_neigh_cache_count(struct nlr_neigh_cache *c);
+/* Call @cb for every entry. Stop if it returns non-zero. */
+int nlr_neigh_cache_foreach(struct nlr_neigh_cache *c,
+			    int (*cb)(const struct nlr_neigh *, void *),
+			    void *priv);
+
+#endif
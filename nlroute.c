@@ -1,50 +1,51 @@
 /*
- * Due to the bug in the kernel netlink code you can not get addresses
- * of only one interface. Kernel always returns addresses of all interfaces.
- * The same is true when you try to get info about the specified interface.
- * Programs depend on this bug, so it will never be fixed.
+ * Old kernels don't filter dumps: you can not get addresses of only one
+ * interface, routes of only one table and so on, the kernel always
+ * returns everything. So for these kernels we do filtering in the
+ * userland.
  *
- * The same thing with get routes: kernel doesn't do filtering at all.
- * See https://patchwork.ozlabs.org/project/netdev/patch/1325080915.26559.43.camel@hakki
- *
- * So, you should do filtering in the userland.
+ * Since Linux 4.20 a socket can set NETLINK_GET_STRICT_CHK (nl_open()
+ * does it) and then the kernel filters dumps by the fields of the request
+ * header and by some attributes: ifindex for addresses, master for
+ * links, table/protocol/type/oif for routes. We push such filters into
+ * requests when strict checking is on, and still check results in the
+ * userland for filters the kernel doesn't support.
  */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <net/if.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/if_arp.h>
+#include <linux/neighbour.h>
+#include <linux/if_bridge.h>
+#include <linux/nexthop.h>
+#include <linux/veth.h>
 
 #include "nlcore.h"
 #include "nlroute.h"
 
+/* Like IFA_RTA()/IFA_PAYLOAD(), but the uapi headers don't have them */
+#ifndef NDA_RTA
+#define NDA_RTA(r) \
+	((struct rtattr *)((char *)(r) + NLMSG_ALIGN(sizeof(struct ndmsg))))
+#endif
+#ifndef NDA_PAYLOAD
+#define NDA_PAYLOAD(n) NLMSG_PAYLOAD(n, sizeof(struct ndmsg))
+#endif
+
 static struct nl_sock nlsock;
+static struct nl_sock lcsock; /* Link cache notifications */
+static struct nl_sock asock; /* Asynchronous requests */
 static int nlr_initialized;
-
-int nlr_init(void)
-{
-	if (!nlr_initialized) {
-		/* Only the first call actually inits. */
-		if (nl_open(&nlsock, NETLINK_ROUTE))
-			return -1;
-	}
-	nlr_initialized++;
-	return 0;
-}
-
-void nlr_fin(void)
-{
-	if (nlr_initialized == 1) {
-		nl_close(&nlsock);
-	}
-	if (nlr_initialized)
-		--nlr_initialized;
-}
+static struct nl_batch batch;
+static int batching;
+static struct nl_arena *arena; /* Where lists are allocated, see nlr_set_arena() */
 
 static char *add_hdr(char *p, void *hdr, int len)
 {
@@ -64,121 +65,397 @@ static char *add_rta(char *p, int type, int len, void *data)
 	return p + RTA_SPACE(len);
 }
 
-struct iface_name_cb_priv {
-	int idx;
-	char name[32];
-};
+void nlr_set_arena(struct nl_arena *a)
+{
+	arena = a;
+}
 
-static int iface_name_cb(struct nlmsghdr *nlhdr, void *_priv)
+static void *obj_alloc(struct nl_arena *a, int size)
 {
-	struct ifinfomsg *ifi;
-	struct rtattr *rta;
-	struct iface_name_cb_priv *priv = (struct iface_name_cb_priv *)_priv;
-	int n;
+	return a ? nl_arena_alloc(a, size) : malloc(size);
+}
 
-	if (!nlhdr)
-		return 0;
+/*
+ * Send request and wait for ACK. Between nlr_batch_begin() and
+ * nlr_batch_end() the request is only queued.
+ */
+static int do_request(char *buf, int len)
+{
+	if (batching)
+		return nl_batch_add(&batch, buf, len) < 0 ? -1 : 0;
 
-	ifi = NLMSG_DATA(nlhdr);
+	if (nl_send_msg(&nlsock, buf, len))
+		return -1;
 
-	if (ifi->ifi_index != priv->idx)
-		return 0;
+	return nl_wait_ack(&nlsock);
+}
 
-	for (rta = IFLA_RTA(ifi), n = RTM_PAYLOAD(nlhdr);
-	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
-		if (rta->rta_type == IFLA_IFNAME) {
-			strncpy(priv->name, RTA_DATA(rta), sizeof(priv->name));
-			break;
-		}
+int nlr_batch_begin(void)
+{
+	if (batching) {
+		ERROR("batch is already started");
+		return -1;
 	}
 
+	nl_batch_reset(&batch);
+	batching = 1;
+
 	return 0;
 }
 
-char *nlr_iface_name(int idx)
+int nlr_batch_end(int *errs)
 {
-	char buf[128], *p;
-	struct ifinfomsg ifi;
-	struct iface_name_cb_priv priv;
+	int r;
 
-	memset(buf, 0, sizeof(buf));
-	p = nlmsg_put_hdr(buf, RTM_GETLINK, NLM_F_DUMP);
+	if (!batching) {
+		ERROR("batch isn't started");
+		return -1;
+	}
 
-	memset(&ifi, 0, sizeof(ifi));
-	ifi.ifi_index = idx;
-	//ifi.ifi_change = 0xffffffff;
-	p = add_hdr(p, &ifi, sizeof(ifi));
+	batching = 0;
+	r = nl_batch_send(&nlsock, &batch, errs);
+	nl_batch_reset(&batch);
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
+	return r;
+}
+
+/*
+ * Link cache: iface idx <--> name maps. It is filled by one RTM_GETLINK
+ * dump and then kept up to date by RTNLGRP_LINK notifications, which
+ * are received on a separate socket (lcsock). So nlr_iface_idx() and
+ * nlr_iface_name() are hash lookups, only a miss drains pending
+ * notifications. Hits can be stale until nlr_link_cache_sync(), which
+ * the caller runs when lcsock is readable or once per batch of lookups.
+ */
+struct link_entry {
+	int idx;
+	char name[IFNAMSIZ];
+	struct link_entry *idx_next; /* Chain in link_cache.by_idx */
+	struct link_entry *name_next; /* Chain in link_cache.by_name */
+};
+
+static struct {
+	struct link_entry **by_idx, **by_name;
+	unsigned size; /* Number of buckets, power of 2 */
+	unsigned n; /* Number of entries */
+	int loaded;
+} link_cache;
+
+static unsigned link_name_hash(const char *name)
+{
+	unsigned h = 2166136261u; /* FNV-1a */
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+static struct link_entry *link_cache_by_idx(int idx)
+{
+	struct link_entry *e;
+
+	if (!link_cache.size)
 		return NULL;
+	e = link_cache.by_idx[(unsigned)idx & (link_cache.size - 1)];
+	while (e && e->idx != idx)
+		e = e->idx_next;
+	return e;
+}
 
-	priv.idx = idx;
-	priv.name[0] = '\0';
+static struct link_entry *link_cache_by_name(const char *name)
+{
+	struct link_entry *e;
 
-	if (nl_recv_msg(&nlsock, RTM_NEWLINK, iface_name_cb, &priv))
+	if (!link_cache.size)
 		return NULL;
+	e = link_cache.by_name[link_name_hash(name) & (link_cache.size - 1)];
+	while (e && strcmp(e->name, name))
+		e = e->name_next;
+	return e;
+}
+
+static void link_cache_unlink_name(struct link_entry *e)
+{
+	struct link_entry **pp;
 
-	return strdup(priv.name);
+	pp = &link_cache.by_name[link_name_hash(e->name) & (link_cache.size - 1)];
+	while (*pp != e)
+		pp = &(*pp)->name_next;
+	*pp = e->name_next;
 }
 
-struct iface_idx_cb_priv {
-	int idx;
-	const char *name;
-};
+static void link_cache_del(int idx)
+{
+	struct link_entry **pp, *e;
+
+	if (!link_cache.size)
+		return;
+
+	pp = &link_cache.by_idx[(unsigned)idx & (link_cache.size - 1)];
+	while (*pp && (*pp)->idx != idx)
+		pp = &(*pp)->idx_next;
+	e = *pp;
+	if (!e)
+		return;
+
+	*pp = e->idx_next;
+	link_cache_unlink_name(e);
+	free(e);
+	link_cache.n--;
+}
+
+/* Double number of buckets and rehash all entries. */
+static int link_cache_grow(void)
+{
+	struct link_entry **by_idx, **by_name, *e, *next;
+	unsigned size, i, h;
+
+	size = link_cache.size ? link_cache.size * 2 : 64;
+	by_idx = calloc(size, sizeof(*by_idx));
+	by_name = calloc(size, sizeof(*by_name));
+	if (!by_idx || !by_name) {
+		ERRNO("failed to alloc link cache");
+		free(by_idx);
+		free(by_name);
+		return -1;
+	}
+
+	for (i = 0; i < link_cache.size; i++) {
+		for (e = link_cache.by_idx[i]; e; e = next) {
+			next = e->idx_next;
+			h = (unsigned)e->idx & (size - 1);
+			e->idx_next = by_idx[h];
+			by_idx[h] = e;
+			h = link_name_hash(e->name) & (size - 1);
+			e->name_next = by_name[h];
+			by_name[h] = e;
+		}
+	}
+
+	free(link_cache.by_idx);
+	free(link_cache.by_name);
+	link_cache.by_idx = by_idx;
+	link_cache.by_name = by_name;
+	link_cache.size = size;
+
+	return 0;
+}
+
+/* Add new entry or update name of the existing one (iface was renamed). */
+static int link_cache_set(int idx, const char *name)
+{
+	struct link_entry *e;
+	unsigned h;
+
+	e = link_cache_by_idx(idx);
+	if (e) {
+		if (!strcmp(e->name, name))
+			return 0;
+		link_cache_unlink_name(e);
+	} else {
+		if (link_cache.n >= link_cache.size && link_cache_grow())
+			return -1;
 
-static int iface_idx_cb(struct nlmsghdr *nlhdr, void *_priv)
+		e = malloc(sizeof(*e));
+		if (!e) {
+			ERRNO("failed to alloc link cache entry");
+			return -1;
+		}
+		e->idx = idx;
+		h = (unsigned)idx & (link_cache.size - 1);
+		e->idx_next = link_cache.by_idx[h];
+		link_cache.by_idx[h] = e;
+		link_cache.n++;
+	}
+
+	strncpy(e->name, name, sizeof(e->name) - 1);
+	e->name[sizeof(e->name) - 1] = '\0';
+	h = link_name_hash(e->name) & (link_cache.size - 1);
+	e->name_next = link_cache.by_name[h];
+	link_cache.by_name[h] = e;
+
+	return 0;
+}
+
+static void link_cache_flush(void)
+{
+	struct link_entry *e, *next;
+	unsigned i;
+
+	for (i = 0; i < link_cache.size; i++) {
+		for (e = link_cache.by_idx[i]; e; e = next) {
+			next = e->idx_next;
+			free(e);
+		}
+	}
+
+	free(link_cache.by_idx);
+	free(link_cache.by_name);
+	memset(&link_cache, 0, sizeof(link_cache));
+}
+
+/* Used both for dump replies and for notifications. */
+static int link_cache_cb(struct nlmsghdr *nlhdr, void *_priv)
 {
 	struct ifinfomsg *ifi;
 	struct rtattr *rta;
-	struct iface_idx_cb_priv *priv = (struct iface_idx_cb_priv *)_priv;
 	int n;
 
 	if (!nlhdr)
 		return 0;
 
+	if (nlhdr->nlmsg_type != RTM_NEWLINK
+	    && nlhdr->nlmsg_type != RTM_DELLINK)
+		return 0;
+
 	ifi = NLMSG_DATA(nlhdr);
 
+	/*
+	 * Bridge sends RTM_NEWLINK/RTM_DELLINK with AF_BRIDGE family when
+	 * a port is added to/removed from it, the iface itself stays.
+	 */
+	if (ifi->ifi_family == AF_BRIDGE)
+		return 0;
+
+	if (nlhdr->nlmsg_type == RTM_DELLINK) {
+		DEBUG("iface #%d is deleted", ifi->ifi_index);
+		link_cache_del(ifi->ifi_index);
+		return 0;
+	}
+
 	for (rta = IFLA_RTA(ifi), n = RTM_PAYLOAD(nlhdr);
 	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
 		if (rta->rta_type == IFLA_IFNAME) {
-			DEBUG("IFLA_NAME: %s", (char *)RTA_DATA(rta));
-			if (!strcmp(priv->name, RTA_DATA(rta))) {
-				priv->idx = ifi->ifi_index;
-				DEBUG("iface %s has idx %d", priv->name,
-				      priv->idx);
-			}
-			break;
+			DEBUG("iface #%d has name %s", ifi->ifi_index,
+			      (char *)RTA_DATA(rta));
+			return link_cache_set(ifi->ifi_index, RTA_DATA(rta));
 		}
 	}
 
 	return 0;
 }
 
-int nlr_iface_idx(const char *name)
+/*
+ * The dump goes through its own short-lived socket: the cache can be
+ * loaded on a miss from a visitor callback (e.g. nlr_foreach_route() ->
+ * nlr_iface_name()), while another dump is read from nlsock.
+ */
+static int link_cache_load(void)
 {
 	char buf[128], *p;
 	struct ifinfomsg ifi;
-	struct iface_idx_cb_priv priv;
+	struct nl_sock sock = { .pid = 0 };
+	int r;
 
-	memset(buf, 0, sizeof(buf));
+	link_cache_flush();
+
+	/* Subscribe before the dump, so we don't miss any changes */
+	if (!NL_IS_OPEN(&lcsock)) {
+		if (nl_open(&lcsock, NETLINK_ROUTE))
+			return -1;
+		if (nl_add_membership(&lcsock, RTNLGRP_LINK)) {
+			nl_close(&lcsock);
+			return -1;
+		}
+	}
 
+	memset(buf, 0, sizeof(buf));
 	p = nlmsg_put_hdr(buf, RTM_GETLINK, NLM_F_DUMP);
 
 	memset(&ifi, 0, sizeof(ifi));
-	//ifi.ifi_change = 0xffffffff;
-	ifi.ifi_flags = 0xffffffff;
 	p = add_hdr(p, &ifi, sizeof(ifi));
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
+	if (nl_open(&sock, NETLINK_ROUTE))
+		return -1;
+
+	r = nl_send_msg(&sock, buf, p - buf);
+	if (!r)
+		r = nl_recv_msg(&sock, RTM_NEWLINK, link_cache_cb, NULL);
+	nl_close(&sock);
+
+	if (r) {
+		link_cache_flush();
 		return -1;
+	}
+
+	link_cache.loaded = 1;
 
-	priv.idx = -1;
-	priv.name = name;
+	return 0;
+}
+
+int nlr_link_cache_sync(void)
+{
+	if (!link_cache.loaded)
+		return link_cache_load();
+
+	if (nl_recv_notify(&lcsock, link_cache_cb, NULL)) {
+		/* Some notifications were lost, the only way is to reload */
+		DEBUG("link cache is out of sync, reload it");
+		return link_cache_load();
+	}
+
+	return 0;
+}
 
-	if (nl_recv_msg(&nlsock, RTM_NEWLINK, iface_idx_cb, &priv))
+int nlr_link_cache_fd(void)
+{
+	if (!link_cache.loaded && link_cache_load())
 		return -1;
+	return lcsock.sock;
+}
+
+/* Hits need no syscalls, a miss reads pending notifications first. */
+char *nlr_iface_name(int idx)
+{
+	struct link_entry *e;
+
+	e = link_cache_by_idx(idx);
+	if (!e) {
+		if (nlr_link_cache_sync())
+			return NULL;
+		e = link_cache_by_idx(idx);
+	}
+
+	return strdup(e ? e->name : "");
+}
+
+int nlr_iface_idx(const char *name)
+{
+	struct link_entry *e;
+
+	e = link_cache_by_name(name);
+	if (!e) {
+		if (nlr_link_cache_sync())
+			return -1;
+		e = link_cache_by_name(name);
+	}
 
-	return priv.idx;
+	return e ? e->idx : -1;
+}
+
+int nlr_init(void)
+{
+	if (!nlr_initialized) {
+		/* Only the first call actually inits. */
+		if (nl_open(&nlsock, NETLINK_ROUTE))
+			return -1;
+	}
+	nlr_initialized++;
+	return 0;
+}
+
+void nlr_fin(void)
+{
+	if (nlr_initialized == 1) {
+		link_cache_flush();
+		nl_batch_free(&batch);
+		batching = 0;
+		nl_close(&lcsock);
+		nl_close(&asock);
+		nl_close(&nlsock);
+	}
+	if (nlr_initialized)
+		--nlr_initialized;
 }
 
 void nlr_iface_free(struct nlr_iface *iface)
@@ -197,7 +474,9 @@ void nlr_iface_free(struct nlr_iface *iface)
 
 struct iface_cb_priv {
 	struct nlr_iface *iface;
+	struct nl_arena *arena; /* NULL -- malloc() */
 	int iface_idx;
+	int master_idx;
 	int err;
 };
 
@@ -216,124 +495,335 @@ static int ifi_type2nlr_iface_type(int ifi_type)
 	}
 }
 
-static int iface_cb(struct nlmsghdr *nlhdr, void *_priv)
+#define RTA_U8(rta) (*(uint8_t *)RTA_DATA(rta))
+#define RTA_U16(rta) (*(uint16_t *)RTA_DATA(rta))
+#define RTA_U32(rta) (*(uint32_t *)RTA_DATA(rta))
+
+static void vlan_parse(struct rtattr *data, struct nlr_iface *iface)
 {
-	struct ifinfomsg *ifi;
 	struct rtattr *rta;
-	struct iface_cb_priv *priv = (struct iface_cb_priv *)_priv;
 	int n;
-	struct nlr_iface *iface;
-	struct rtnl_link_stats *stats;
-
-	if (!nlhdr || priv->err)
-		return 0;
 
-	ifi = NLMSG_DATA(nlhdr);
+	for (rta = RTA_DATA(data), n = RTA_PAYLOAD(data);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		if (rta->rta_type == IFLA_VLAN_ID)
+			iface->options.vlan.id = RTA_U16(rta);
+		else if (rta->rta_type == IFLA_VLAN_PROTOCOL)
+			iface->options.vlan.proto = ntohs(RTA_U16(rta));
+	}
+}
 
-	if (priv->iface_idx >= 0 && priv->iface_idx != ifi->ifi_index)
-		return 0;
+static void bond_parse(struct rtattr *data, struct nlr_iface *iface)
+{
+	struct rtattr *rta;
+	int n;
 
-	iface = calloc(1, sizeof(struct nlr_iface));
-	if (!iface) {
-		ERRNO("failed to alloc nlr_iface");
-		priv->err = 1;
-		return 0;
+	for (rta = RTA_DATA(data), n = RTA_PAYLOAD(data);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		if (rta->rta_type == IFLA_BOND_MODE)
+			iface->options.bond.mode = RTA_U8(rta);
+		else if (rta->rta_type == IFLA_BOND_MIIMON)
+			iface->options.bond.miimon = RTA_U32(rta);
+		else if (rta->rta_type == IFLA_BOND_ACTIVE_SLAVE)
+			iface->options.bond.active_slave_idx = RTA_U32(rta);
 	}
+}
 
-	iface->idx = ifi->ifi_index;
-	iface->type = ifi_type2nlr_iface_type(ifi->ifi_type);
-	iface->is_up = ifi->ifi_flags & IFF_UP;
-	iface->carrier_on = ifi->ifi_flags & IFF_LOWER_UP;
-	iface->mtu = -1;
-	iface->master_idx = -1;
-	iface->link_idx = -1;
+static void vxlan_parse(struct rtattr *data, struct nlr_iface *iface)
+{
+	struct rtattr *rta;
+	int n;
 
-	for (rta = IFLA_RTA(ifi), n = RTM_PAYLOAD(nlhdr);
+	for (rta = RTA_DATA(data), n = RTA_PAYLOAD(data);
 	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
-		if (rta->rta_type == IFLA_IFNAME) {
-			iface->name = strdup(RTA_DATA(rta));
-		} else if (rta->rta_type == IFLA_MTU) {
-			iface->mtu = *(int *)RTA_DATA(rta);
-		} else if (rta->rta_type == IFLA_ADDRESS) {
-			memcpy(iface->addr, RTA_DATA(rta), 6);
-		} else if (rta->rta_type == IFLA_STATS) {
-			stats = (struct rtnl_link_stats *)RTA_DATA(rta);
-			iface->stats.tx_bytes = stats->tx_bytes;
-			iface->stats.tx_packets = stats->tx_packets;
-			iface->stats.rx_bytes = stats->rx_bytes;
-			iface->stats.rx_packets = stats->rx_packets;
-		} else if (rta->rta_type == IFLA_MASTER) {
-			iface->master_idx = *(int *)RTA_DATA(rta);
-		} else if (rta->rta_type == IFLA_LINK) {
-			iface->link_idx = *(int *)RTA_DATA(rta);
-		} else if (rta->rta_type == IFLA_LINKINFO) {
-			int m;
-			struct rtattr *rta2;
-			for (rta2 = RTA_DATA(rta), m = RTA_PAYLOAD(rta);
-				RTA_OK(rta2, m); rta2 = RTA_NEXT(rta2, m)) {
-				if (rta2->rta_type == IFLA_INFO_KIND) {
-					char kind[32];
-					int l = RTA_PAYLOAD(rta2);
-					if (l > sizeof(kind) + 1) {
-						DEBUG("IFLA_INFO_KIND payload is greater then our static buffer");
-						continue;
-					}
-					memcpy(kind, RTA_DATA(rta2), l);
-					kind[l] = '\0';
-					if (!strcmp(kind, "bridge"))
-						iface->type =
-							NLR_IFACE_TYPE_BRIDGE;
-					else if (!strcmp(kind, "vlan"))
-						iface->type =
-							NLR_IFACE_TYPE_VLAN;
-					else if (!strcmp(kind, "tun"))
-						iface->type =
-							NLR_IFACE_TYPE_TUNNEL;
-					else if (!strcmp(kind, "bond"))
-						iface->type =
-							NLR_IFACE_TYPE_BONDING;
-				} else if (rta2->rta_type == IFLA_INFO_DATA) {
-					/* TODO: get VLAN id */
-				}
-			}
+		switch (rta->rta_type) {
+		case IFLA_VXLAN_ID:
+			iface->options.vxlan.vni = RTA_U32(rta);
+			break;
+		case IFLA_VXLAN_LOCAL:
+			iface->options.vxlan.local = RTA_U32(rta);
+			break;
+		case IFLA_VXLAN_GROUP:
+			iface->options.vxlan.group = RTA_U32(rta);
+			break;
+		case IFLA_VXLAN_LINK:
+			iface->options.vxlan.link_idx = RTA_U32(rta);
+			break;
+		case IFLA_VXLAN_PORT:
+			iface->options.vxlan.port = ntohs(RTA_U16(rta));
+			break;
+		case IFLA_VXLAN_TTL:
+			iface->options.vxlan.ttl = RTA_U8(rta);
+			break;
+		case IFLA_VXLAN_LEARNING:
+			iface->options.vxlan.learning = RTA_U8(rta);
+			break;
+		default:
+			break;
 		}
 	}
+}
 
-	iface->pnext = priv->iface;
-	priv->iface = iface;
+static void macvlan_parse(struct rtattr *data, struct nlr_iface *iface)
+{
+	struct rtattr *rta;
+	int n;
 
-	return 0;
+	for (rta = RTA_DATA(data), n = RTA_PAYLOAD(data);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		if (rta->rta_type == IFLA_MACVLAN_MODE)
+			iface->options.macvlan.mode = RTA_U32(rta);
+	}
 }
 
-struct nlr_iface *nlr_iface(int iface_idx, int *err)
+static void bridge_parse(struct rtattr *data, struct nlr_iface *iface)
 {
-	char buf[128], *p;
-	struct ifinfomsg ifi;
-	struct iface_cb_priv priv;
+	struct rtattr *rta;
+	int n;
 
-	if (err)
-		*err = -1;
+	for (rta = RTA_DATA(data), n = RTA_PAYLOAD(data);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		switch (rta->rta_type) {
+		case IFLA_BR_STP_STATE:
+			iface->options.bridge.stp = RTA_U32(rta);
+			break;
+		case IFLA_BR_VLAN_FILTERING:
+			iface->options.bridge.vlan_filtering = RTA_U8(rta);
+			break;
+		case IFLA_BR_AGEING_TIME:
+			iface->options.bridge.ageing_time = RTA_U32(rta);
+			break;
+		case IFLA_BR_PRIORITY:
+			iface->options.bridge.priority = RTA_U16(rta);
+			break;
+		default:
+			break;
+		}
+	}
+}
 
-	memset(buf, 0, sizeof(buf));
+static const struct {
+	const char *kind;
+	enum nlr_iface_type type;
+	void (*parse)(struct rtattr *, struct nlr_iface *);
+} link_kinds[] = {
+	{ "bridge", NLR_IFACE_TYPE_BRIDGE, bridge_parse },
+	{ "vlan", NLR_IFACE_TYPE_VLAN, vlan_parse },
+	{ "tun", NLR_IFACE_TYPE_TUNNEL, NULL },
+	{ "bond", NLR_IFACE_TYPE_BONDING, bond_parse },
+	{ "vxlan", NLR_IFACE_TYPE_VXLAN, vxlan_parse },
+	{ "macvlan", NLR_IFACE_TYPE_MACVLAN, macvlan_parse },
+};
 
-	p = nlmsg_put_hdr(buf, RTM_GETLINK, NLM_F_DUMP);
+/*
+ * IFLA_LINKINFO: kind of the link and its options in IFLA_INFO_DATA.
+ * The kernel puts the kind first, but don't rely on it.
+ */
+static void linkinfo_parse(struct rtattr *linkinfo, struct nlr_iface *iface)
+{
+	struct rtattr *rta, *kind = NULL, *data = NULL;
+	int n, i;
+
+	for (rta = RTA_DATA(linkinfo), n = RTA_PAYLOAD(linkinfo);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		if (rta->rta_type == IFLA_INFO_KIND)
+			kind = rta;
+		else if (rta->rta_type == IFLA_INFO_DATA)
+			data = rta;
+	}
+
+	if (!kind)
+		return;
+
+	for (i = 0; i < sizeof(link_kinds) / sizeof(link_kinds[0]); i++) {
+		/* The payload may or may not include '\0' */
+		if (strncmp(RTA_DATA(kind), link_kinds[i].kind,
+			    RTA_PAYLOAD(kind))
+		    || RTA_PAYLOAD(kind) < strlen(link_kinds[i].kind))
+			continue;
+
+		iface->type = link_kinds[i].type;
+		if (data && link_kinds[i].parse)
+			link_kinds[i].parse(data, iface);
+		return;
+	}
+}
+
+/*
+ * Decode RTM_NEWLINK/RTM_DELLINK message into @iface. No allocations:
+ * @iface->name points into the message.
+ */
+static void iface_parse(struct nlmsghdr *nlhdr, struct nlr_iface *iface)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nlhdr);
+	struct rtattr *rta;
+	int n;
+	struct rtnl_link_stats *stats;
+
+	memset(iface, 0, sizeof(*iface));
+
+	iface->idx = ifi->ifi_index;
+	iface->type = ifi_type2nlr_iface_type(ifi->ifi_type);
+	iface->is_up = ifi->ifi_flags & IFF_UP;
+	iface->carrier_on = ifi->ifi_flags & IFF_LOWER_UP;
+	iface->mtu = -1;
+	iface->master_idx = -1;
+	iface->link_idx = -1;
+
+	for (rta = IFLA_RTA(ifi), n = RTM_PAYLOAD(nlhdr);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			iface->name = RTA_DATA(rta);
+		} else if (rta->rta_type == IFLA_MTU) {
+			iface->mtu = *(int *)RTA_DATA(rta);
+		} else if (rta->rta_type == IFLA_ADDRESS) {
+			memcpy(iface->addr, RTA_DATA(rta), 6);
+		} else if (rta->rta_type == IFLA_STATS) {
+			stats = (struct rtnl_link_stats *)RTA_DATA(rta);
+			iface->stats.tx_bytes = stats->tx_bytes;
+			iface->stats.tx_packets = stats->tx_packets;
+			iface->stats.rx_bytes = stats->rx_bytes;
+			iface->stats.rx_packets = stats->rx_packets;
+		} else if (rta->rta_type == IFLA_MASTER) {
+			iface->master_idx = *(int *)RTA_DATA(rta);
+		} else if (rta->rta_type == IFLA_LINK) {
+			iface->link_idx = *(int *)RTA_DATA(rta);
+		} else if (rta->rta_type == IFLA_LINKINFO) {
+			linkinfo_parse(rta, iface);
+		}
+	}
+}
+
+static int iface_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct ifinfomsg *ifi;
+	struct iface_cb_priv *priv = (struct iface_cb_priv *)_priv;
+	struct nlr_iface tmp, *iface;
+
+	if (!nlhdr || priv->err)
+		return 0;
+
+	ifi = NLMSG_DATA(nlhdr);
+
+	if (priv->iface_idx >= 0 && priv->iface_idx != ifi->ifi_index)
+		return 0;
+
+	iface_parse(nlhdr, &tmp);
+
+	/* Old kernels ignore IFLA_MASTER filter in the request */
+	if (priv->master_idx >= 0 && priv->master_idx != tmp.master_idx)
+		return 0;
+
+	if (!tmp.name)
+		tmp.name = "";
+
+	if (priv->arena) {
+		/* The name is stored right after the struct */
+		iface = nl_arena_alloc(priv->arena,
+				       sizeof(*iface) + strlen(tmp.name) + 1);
+		if (!iface) {
+			priv->err = 1;
+			return 0;
+		}
+		*iface = tmp;
+		iface->name = strcpy((char *)(iface + 1), tmp.name);
+		iface->pnext = priv->iface;
+		priv->iface = iface;
+		return 0;
+	}
+
+	iface = malloc(sizeof(struct nlr_iface));
+	if (!iface) {
+		ERRNO("failed to alloc nlr_iface");
+		priv->err = 1;
+		return 0;
+	}
+
+	*iface = tmp;
+	iface->name = strdup(tmp.name);
+	if (!iface->name) {
+		ERRNO("failed to alloc iface name");
+		free(iface);
+		priv->err = 1;
+		return 0;
+	}
+
+	iface->pnext = priv->iface;
+	priv->iface = iface;
+
+	return 0;
+}
+
+/*
+ * Build RTM_GETLINK request into @buf, return its length. If @iface_idx>=0
+ * or @name is set, ask the kernel about this iface only (request without
+ * NLM_F_DUMP): we get one message instead of all ifaces.
+ */
+static int iface_req(char *buf, int iface_idx, const char *name,
+		     int master_idx)
+{
+	char *p;
+	struct ifinfomsg ifi;
+	int single = iface_idx >= 0 || name;
+
+	if (name && strlen(name) >= IFNAMSIZ) {
+		ERROR("too long iface name: %s", name);
+		return -1;
+	}
+
+	memset(buf, 0, 128);
+
+	p = nlmsg_put_hdr(buf, RTM_GETLINK, single ? 0 : NLM_F_DUMP);
 
 	memset(&ifi, 0, sizeof(ifi));
-	//ifi.ifi_change = 0xffffffff;
+	if (iface_idx >= 0)
+		ifi.ifi_index = iface_idx;
 	p = add_hdr(p, &ifi, sizeof(ifi));
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
+	if (name)
+		p = add_rta(p, IFLA_IFNAME, strlen(name) + 1, (char *)name);
+
+	if (!single && master_idx >= 0)
+		p = add_rta(p, IFLA_MASTER, 4, &master_idx);
+
+	return p - buf;
+}
+
+static struct nlr_iface *get_iface(int iface_idx, const char *name,
+				   int master_idx, int *err)
+{
+	char buf[128];
+	int len;
+	struct iface_cb_priv priv;
+
+	if (err)
+		*err = -1;
+
+	len = iface_req(buf, iface_idx, name, master_idx);
+	if (len < 0)
+		return NULL;
+
+	if (nl_send_msg(&nlsock, buf, len))
 		return NULL;
 
 	priv.iface = NULL;
+	priv.arena = arena;
 	priv.err = 0;
 	priv.iface_idx = iface_idx;
-
-	if (nl_recv_msg(&nlsock, RTM_NEWLINK, iface_cb, &priv))
+	priv.master_idx = master_idx;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWLINK, iface_cb, &priv)) {
+		/* No such iface -- it's not an error, just empty result */
+		if (errno == ENODEV && err)
+			*err = 0;
+		if (!priv.arena)
+			nlr_iface_free(priv.iface);
 		return NULL;
+	}
 
 	if (priv.err) {
-		nlr_iface_free(priv.iface);
+		if (!priv.arena)
+			nlr_iface_free(priv.iface);
 		return NULL;
 	}
 
@@ -343,6 +833,193 @@ struct nlr_iface *nlr_iface(int iface_idx, int *err)
 	return priv.iface;
 }
 
+struct nlr_iface *nlr_iface(int iface_idx, int *err)
+{
+	return get_iface(iface_idx, NULL, -1, err);
+}
+
+struct nlr_iface *nlr_iface_by_name(const char *name, int *err)
+{
+	return get_iface(-1, name, -1, err);
+}
+
+struct nlr_iface *nlr_iface_by_master(int master_idx, int *err)
+{
+	return get_iface(-1, NULL, master_idx, err);
+}
+
+struct iface_foreach_priv {
+	int iface_idx;
+	int (*cb)(struct nlr_iface *, void *);
+	void *priv;
+	int stopped;
+};
+
+static int iface_foreach_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct iface_foreach_priv *priv = (struct iface_foreach_priv *)_priv;
+	struct nlr_iface iface;
+
+	if (!nlhdr)
+		return 0;
+
+	if (priv->iface_idx >= 0 && priv->iface_idx !=
+	    ((struct ifinfomsg *)NLMSG_DATA(nlhdr))->ifi_index)
+		return 0;
+
+	iface_parse(nlhdr, &iface);
+	if (!iface.name)
+		iface.name = "";
+
+	if (priv->cb(&iface, priv->priv)) {
+		priv->stopped = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nlr_foreach_iface(int iface_idx,
+		      int (*cb)(struct nlr_iface *, void *), void *priv)
+{
+	char buf[128];
+	int len;
+	struct iface_foreach_priv fpriv;
+
+	len = iface_req(buf, iface_idx, NULL, -1);
+	if (len < 0)
+		return -1;
+
+	if (nl_send_msg(&nlsock, buf, len))
+		return -1;
+
+	fpriv.iface_idx = iface_idx;
+	fpriv.cb = cb;
+	fpriv.priv = priv;
+	fpriv.stopped = 0;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWLINK, iface_foreach_cb, &fpriv)) {
+		/* No such iface -- nothing to walk */
+		if (fpriv.stopped || errno == ENODEV)
+			return 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Counters: RTM_GETSTATS asks only for IFLA_STATS_LINK_64, so a reply is
+ * ~200 bytes per iface instead of a full RTM_NEWLINK.
+ */
+struct stats_priv {
+	int (*cb)(struct nlr_link_stats *, void *);
+	void *priv;
+	int stopped;
+};
+
+static int stats_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct stats_priv *priv = (struct stats_priv *)_priv;
+	struct if_stats_msg *ism;
+	struct rtnl_link_stats64 *s;
+	struct nlr_link_stats stats;
+	struct rtattr *rta;
+	int n;
+
+	if (!nlhdr)
+		return 0;
+
+	ism = NLMSG_DATA(nlhdr);
+
+	for (rta = (struct rtattr *)((char *)ism + NLMSG_ALIGN(sizeof(*ism))),
+	     n = NLMSG_PAYLOAD(nlhdr, sizeof(*ism));
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		if (rta->rta_type != IFLA_STATS_LINK_64
+		    || RTA_PAYLOAD(rta) < sizeof(*s))
+			continue;
+
+		s = RTA_DATA(rta);
+		stats.iface_idx = ism->ifindex;
+		stats.rx_packets = s->rx_packets;
+		stats.tx_packets = s->tx_packets;
+		stats.rx_bytes = s->rx_bytes;
+		stats.tx_bytes = s->tx_bytes;
+		stats.rx_errors = s->rx_errors;
+		stats.tx_errors = s->tx_errors;
+		stats.rx_dropped = s->rx_dropped;
+		stats.tx_dropped = s->tx_dropped;
+		stats.multicast = s->multicast;
+		stats.collisions = s->collisions;
+
+		if (priv->cb(&stats, priv->priv)) {
+			priv->stopped = 1;
+			return -1;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+int nlr_foreach_link_stats(int iface_idx,
+			   int (*cb)(struct nlr_link_stats *, void *),
+			   void *priv)
+{
+	char buf[64], *p;
+	struct if_stats_msg ism;
+	struct stats_priv spriv;
+
+	memset(buf, 0, sizeof(buf));
+
+	/* One iface is a plain request, not a dump */
+	p = nlmsg_put_hdr(buf, RTM_GETSTATS, iface_idx > 0 ? 0 : NLM_F_DUMP);
+
+	memset(&ism, 0, sizeof(ism));
+	ism.family = AF_UNSPEC;
+	ism.ifindex = iface_idx > 0 ? iface_idx : 0;
+	ism.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+
+	p = add_hdr(p, &ism, sizeof(ism));
+
+	if (nl_send_msg(&nlsock, buf, p - buf))
+		return -1;
+
+	spriv.cb = cb;
+	spriv.priv = priv;
+	spriv.stopped = 0;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWSTATS, stats_cb, &spriv)) {
+		if (spriv.stopped)
+			return 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int stats_copy_cb(struct nlr_link_stats *s, void *stats)
+{
+	*(struct nlr_link_stats *)stats = *s;
+
+	return 0;
+}
+
+int nlr_get_link_stats(int iface_idx, struct nlr_link_stats *stats)
+{
+	stats->iface_idx = -1;
+
+	if (nlr_foreach_link_stats(iface_idx, stats_copy_cb, stats))
+		return -1;
+
+	if (stats->iface_idx < 0) {
+		ERROR("no stats of iface %d", iface_idx);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int iface_set_flags(int iface_idx, int flags)
 {
 	char buf[128], *p;
@@ -360,10 +1037,7 @@ static int iface_set_flags(int iface_idx, int flags)
 
 	p = add_hdr(p, &ifi, sizeof(ifi));
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
-		return -1;
-
-	return nl_wait_ack(&nlsock);
+	return do_request(buf, p - buf);
 }
 
 int nlr_set_iface(int iface_idx, int up)
@@ -392,10 +1066,7 @@ static int manage_addr(int iface_idx, in_addr_t addr, int prefix_len,
 	p = add_rta(p, IFA_LOCAL, 4, &addr);
 	/* p = add_rta(p, IFA_ADDRESS, 4, &addr); */
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
-		return -1;
-
-	return nl_wait_ack(&nlsock);
+	return do_request(buf, p - buf);
 }
 
 int nlr_add_addr(int iface_idx, in_addr_t addr, int prefix_len)
@@ -411,98 +1082,127 @@ int nlr_del_addr(int iface_idx, in_addr_t addr, int prefix_len)
 
 struct addr_cb_priv {
 	struct nlr_addr *addr;
+	struct nl_arena *arena;
 	int iface_idx;
 	int err;
 };
 
-static int addr_cb(struct nlmsghdr *nlhdr, void *_priv)
+/* Decode RTM_NEWADDR/RTM_DELADDR message. Return -1 if there is no addr. */
+static int addr_parse(struct nlmsghdr *nlhdr, struct nlr_addr *addr)
 {
-	struct addr_cb_priv *priv = (struct addr_cb_priv *)_priv;
-	struct ifaddrmsg *ifa;
+	struct ifaddrmsg *ifa = NLMSG_DATA(nlhdr);
 	struct rtattr *rta;
 	int n;
-	struct in_addr in;
-	struct nlr_addr *addr;
-
-	if (!nlhdr || priv->err)
-		return 0;
-
-	ifa = NLMSG_DATA(nlhdr);
-
-	if (ifa->ifa_family != AF_INET)
-		return 0;
-
-	if (priv->iface_idx >= 0 && priv->iface_idx != ifa->ifa_index)
-		return 0;
 
 	for (rta = IFA_RTA(ifa), n = RTM_PAYLOAD(nlhdr);
 	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
 		if (rta->rta_type == IFA_ADDRESS) {
-			in.s_addr = *(in_addr_t *)RTA_DATA(rta);
-			DEBUG("%d %s/%d", ifa->ifa_index,
-			       inet_ntoa(in), ifa->ifa_prefixlen);
-
-			addr = malloc(sizeof(struct nlr_addr));
-			if (!addr) {
-				ERRNO("failed to alloc nlr_addr");
-				priv->err = 1;
-				return 0;
-			}
-
 			addr->iface_idx = ifa->ifa_index;
 			addr->addr = *(in_addr_t *)RTA_DATA(rta);
 			addr->prefix_len = ifa->ifa_prefixlen;
-
-			addr->pnext = priv->addr;
-			priv->addr = addr;
+			addr->pnext = NULL;
+			return 0;
 		}
 	}
 
-	return 0;
+	return -1;
 }
 
-void nlr_addr_free(struct nlr_addr *addr)
+static int addr_cb(struct nlmsghdr *nlhdr, void *_priv)
 {
-	struct nlr_addr *p;
+	struct addr_cb_priv *priv = (struct addr_cb_priv *)_priv;
+	struct ifaddrmsg *ifa;
+	struct nlr_addr tmp, *addr;
 
-	while (addr) {
-		p = addr->pnext;
-		free(addr);
+	if (!nlhdr || priv->err)
+		return 0;
+
+	ifa = NLMSG_DATA(nlhdr);
+
+	if (ifa->ifa_family != AF_INET)
+		return 0;
+
+	if (priv->iface_idx >= 0 && priv->iface_idx != ifa->ifa_index)
+		return 0;
+
+	if (addr_parse(nlhdr, &tmp))
+		return 0;
+
+	addr = obj_alloc(priv->arena, sizeof(struct nlr_addr));
+	if (!addr) {
+		ERRNO("failed to alloc nlr_addr");
+		priv->err = 1;
+		return 0;
+	}
+
+	*addr = tmp;
+	addr->pnext = priv->addr;
+	priv->addr = addr;
+
+	return 0;
+}
+
+void nlr_addr_free(struct nlr_addr *addr)
+{
+	struct nlr_addr *p;
+
+	while (addr) {
+		p = addr->pnext;
+		free(addr);
 		addr = p;
 	}
 }
 
-struct nlr_addr *nlr_get_addr(int iface_idx, int *err)
+static int addr_req(struct nl_sock *sock, char *buf, int iface_idx)
 {
-	char buf[64], *p;
+	char *p;
 	struct ifaddrmsg ifa;
-	struct addr_cb_priv priv;
-
-	if (err)
-		*err = -1;
 
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, 64);
 
 	p = nlmsg_put_hdr(buf, RTM_GETADDR, NLM_F_DUMP);
 
 	memset(&ifa, 0, sizeof(ifa));
 	ifa.ifa_family = AF_INET;
-	/* ifa.ifa_index = iface_idx; */
+	if (sock->strict_chk && iface_idx >= 0)
+		ifa.ifa_index = iface_idx;
 
 	p = add_hdr(p, &ifa, sizeof(ifa));
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
+	return p - buf;
+}
+
+struct nlr_addr *nlr_get_addr(int iface_idx, int *err)
+{
+	char buf[64];
+	int len;
+	struct addr_cb_priv priv;
+
+	if (err)
+		*err = -1;
+
+	len = addr_req(&nlsock, buf, iface_idx);
+
+	if (nl_send_msg(&nlsock, buf, len))
 		return NULL;
 
 	priv.addr = NULL;
+	priv.arena = arena;
 	priv.err = 0;
 	priv.iface_idx = iface_idx;
 
-	if (nl_recv_msg(&nlsock, RTM_NEWADDR, addr_cb, &priv))
+	if (nl_recv_msg(&nlsock, RTM_NEWADDR, addr_cb, &priv)) {
+		/* Filtered by nonexistent iface: no addresses */
+		if (errno == ENODEV && err)
+			*err = 0;
+		if (!priv.arena)
+			nlr_addr_free(priv.addr);
 		return NULL;
+	}
 
 	if (priv.err) {
-		nlr_addr_free(priv.addr);
+		if (!priv.arena)
+			nlr_addr_free(priv.addr);
 		return NULL;
 	}
 
@@ -512,6 +1212,67 @@ struct nlr_addr *nlr_get_addr(int iface_idx, int *err)
 	return priv.addr;
 }
 
+struct addr_foreach_priv {
+	int iface_idx;
+	int (*cb)(struct nlr_addr *, void *);
+	void *priv;
+	int stopped;
+};
+
+static int addr_foreach_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct addr_foreach_priv *priv = (struct addr_foreach_priv *)_priv;
+	struct ifaddrmsg *ifa;
+	struct nlr_addr addr;
+
+	if (!nlhdr)
+		return 0;
+
+	ifa = NLMSG_DATA(nlhdr);
+
+	if (ifa->ifa_family != AF_INET)
+		return 0;
+
+	if (priv->iface_idx >= 0 && priv->iface_idx != ifa->ifa_index)
+		return 0;
+
+	if (addr_parse(nlhdr, &addr))
+		return 0;
+
+	if (priv->cb(&addr, priv->priv)) {
+		priv->stopped = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nlr_foreach_addr(int iface_idx,
+		     int (*cb)(struct nlr_addr *, void *), void *priv)
+{
+	char buf[64];
+	int len;
+	struct addr_foreach_priv fpriv;
+
+	len = addr_req(&nlsock, buf, iface_idx);
+
+	if (nl_send_msg(&nlsock, buf, len))
+		return -1;
+
+	fpriv.iface_idx = iface_idx;
+	fpriv.cb = cb;
+	fpriv.priv = priv;
+	fpriv.stopped = 0;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWADDR, addr_foreach_cb, &fpriv)) {
+		if (fpriv.stopped || errno == ENODEV)
+			return 0;
+		return -1;
+	}
+
+	return 0;
+}
+
 /* Iface must be down? */
 int nlr_set_mac_addr(int iface_idx, char addr[6])
 {
@@ -530,10 +1291,7 @@ int nlr_set_mac_addr(int iface_idx, char addr[6])
 
 	p = add_rta(p, IFLA_ADDRESS, 6, addr);
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
-		return -1;
-
-	return nl_wait_ack(&nlsock);
+	return do_request(buf, p - buf);
 }
 
 void nlr_free_routes(struct nlr_route *r)
@@ -547,42 +1305,38 @@ void nlr_free_routes(struct nlr_route *r)
 	}
 }
 
+struct nlr_route_pred {
+	struct nlr_route filter;
+	int filtered; /* @filter is set */
+	uint32_t protos[8]; /* Bitmap of allowed protocols */
+	int n_protos;
+	struct pred_range {
+		uint32_t lo, hi; /* Host order */
+		int ge, le;
+	} *ranges;
+	int n_ranges;
+};
+
 struct route_cb_priv {
 	struct nlr_route *route, *end;
+	struct nl_arena *arena;
+	struct nlr_route_pred *pred; /* NULL -- get all */
 	int err;
 };
 
 /*
-https://man7.org/linux/man-pages/man7/rtnetlink.7.html
-*/
-static int route_cb(struct nlmsghdr *nlhdr, void *_priv)
+ * https://man7.org/linux/man-pages/man7/rtnetlink.7.html
+ *
+ * Nexthops of a multipath route are only counted: @p->n_nhs is set and
+ * RTA_MULTIPATH is returned, the caller decodes them by route_parse_nhs()
+ * where it has room for them.
+ */
+static struct rtattr *route_parse(struct nlmsghdr *nlhdr, struct nlr_route *p)
 {
-	struct route_cb_priv *priv = (struct route_cb_priv *)_priv;
-	struct rtmsg *r;
-	struct rtattr *rta;
-	int n;
-	struct nlr_route *p;
-
-	if (!nlhdr || priv->err)
-		return 0;
-
-	r = NLMSG_DATA(nlhdr);
-
-	if (r->rtm_family != AF_INET)
-		return 0;
-
-	p = calloc(sizeof(*p), 1);
-	if (!p) {
-		priv->err = 1;
-		return 0;
-	}
-	p->pnext = NULL;
-	if (priv->end) {
-		priv->end->pnext = p;
-	} else {
-		priv->route = p;
-	}
-	priv->end = p;
+	struct rtmsg *r = NLMSG_DATA(nlhdr);
+	struct rtattr *rta, *mp = NULL;
+	struct rtnexthop *nh;
+	int n, len;
 
 	p->table = r->rtm_table;
 	p->type = r->rtm_type;
@@ -608,205 +1362,1691 @@ static int route_cb(struct nlmsghdr *nlhdr, void *_priv)
 			p->dest = *(in_addr_t *)RTA_DATA(rta);
 			p->dest_plen = r->rtm_dst_len;
 			break;
-		case RTA_TABLE: /* Equals to r->rtm_table? */
+		case RTA_TABLE: /* rtm_table is 8-bit, this is a full id */
+			p->table = *(uint32_t *)RTA_DATA(rta);
 			break;
 		case RTA_OIF: /* Output interface */
 			p->oif = *(int *)RTA_DATA(rta);
 			break;
+		case RTA_NH_ID:
+			p->nh_id = *(uint32_t *)RTA_DATA(rta);
+			break;
+		case RTA_MULTIPATH:
+			mp = rta;
+			for (nh = RTA_DATA(rta), len = RTA_PAYLOAD(rta);
+			     RTNH_OK(nh, len); len -= RTNH_ALIGN(nh->rtnh_len),
+			     nh = RTNH_NEXT(nh))
+				p->n_nhs++;
+			break;
 		default:
 			break;
 		}
 	}
 
-	return 0;
+	return p->n_nhs ? mp : NULL;
 }
 
-struct nlr_route *nlr_get_routes(struct nlr_route *filter, int *err)
+static void route_parse_nhs(struct rtattr *mp, struct nlr_nh *v)
 {
-	char buf[64], *p;
-	struct rtmsg r;
-	struct route_cb_priv priv;
-	struct nlr_route *prev, *q;
-
-	if (err)
-		*err = -1;
-
-	memset(buf, 0, sizeof(buf));
-
-	p = nlmsg_put_hdr(buf, RTM_GETROUTE, NLM_F_DUMP);
+	struct rtnexthop *nh;
+	struct rtattr *rta;
+	int len, n;
+
+	for (nh = RTA_DATA(mp), len = RTA_PAYLOAD(mp); RTNH_OK(nh, len);
+	     len -= RTNH_ALIGN(nh->rtnh_len), nh = RTNH_NEXT(nh), v++) {
+		v->gw = 0;
+		v->oif = nh->rtnh_ifindex;
+		v->weight = nh->rtnh_hops + 1;
+		v->flags = nh->rtnh_flags;
+		for (rta = RTNH_DATA(nh), n = nh->rtnh_len - sizeof(*nh);
+		     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+			if (rta->rta_type == RTA_GATEWAY)
+				v->gw = *(in_addr_t *)RTA_DATA(rta);
+		}
+	}
+}
 
-	memset(&r, 0, sizeof(r));
-	r.rtm_family = AF_INET;
+/* Room for nexthops of multipath routes in visitors and monitors */
+struct nhs_buf {
+	struct nlr_nh *v;
+	int size;
+};
 
-	p = add_hdr(p, &r, sizeof(r));
+static struct nlr_nh *nhs_buf_get(struct nhs_buf *b, int n)
+{
+	struct nlr_nh *v;
 
-	if (filter) {
-		/* Kernel doesn't do filtering at all :( */
-		/*
-		if (filter->table >= 0) {
-			p = add_rta(p, RTA_TABLE, 4, &filter->table);
-			r.rtm_table = filter->table;
-		}
-		if (filter->type >= 0)
-			r.rtm_type = filter->type;
-		if (filter->scope >= 0)
-			r.rtm_scope = filter->scope;
-		if (filter->proto >= 0)
-			r.rtm_protocol = filter->proto;
-		if (filter->oif >= 0)
-			p = add_rta(p, RTA_OIF, sizeof(int), &filter->oif);
-		if (filter->gw != INADDR_NONE)
-			p = add_rta(p, RTA_GATEWAY, 4, &filter->gw);
-		if (filter->dest != INADDR_NONE) {
-			p = add_rta(p, RTA_DST, 4, &filter->dest);
-			r.rtm_dst_len = filter->dest_plen;
+	if (n > b->size) {
+		v = realloc(b->v, n * sizeof(*v));
+		if (!v) {
+			ERRNO("failed to alloc %d nexthops", n);
+			return NULL;
 		}
-		*/
+		b->v = v;
+		b->size = n;
 	}
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
-		return NULL;
+	return b->v;
+}
 
-	priv.route = priv.end = NULL;
-	priv.err = 0;
+static int route_pred_hdr(struct nlr_route_pred *pred, struct rtmsg *r);
 
-	if (nl_recv_msg(&nlsock, RTM_NEWROUTE, route_cb, &priv))
-		return NULL;
+static int route_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct route_cb_priv *priv = (struct route_cb_priv *)_priv;
+	struct nlr_route tmp, *p;
+	struct rtattr *mp;
 
-	if (priv.err) {
-		nlr_free_routes(priv.route);
-		priv.route = NULL;
-		return NULL;
-	}
+	if (!nlhdr || priv->err)
+		return 0;
 
-	if (err)
-		*err = 0;
+	/* Rejected routes are never allocated */
+	if (!route_pred_hdr(priv->pred, NLMSG_DATA(nlhdr)))
+		return 0;
 
-	if (filter) {
-		for (prev = NULL, q = priv.route; q; ) {
-			if (filter->table >= 0 && q->table != filter->table
-			  || filter->type >= 0 && q->type != filter->type
-			  || filter->scope >= 0 && q->scope != filter->scope
-			  || filter->proto >= 0 && q->proto != filter->proto
-			  || filter->gw != INADDR_NONE && q->gw != filter->gw
-			  || filter->dest != INADDR_NONE && (q->dest !=
-			  filter->dest || q->dest_plen != filter->dest_plen)) {
-				/* Delete route from the result list */
-				if (prev) {
-					prev->pnext = q->pnext;
-					free(q);
-					q = prev->pnext;
-				} else {
-					priv.route = q->pnext;
-					free(q);
-					q = priv.route->pnext;
-				}
-			} else {
-				prev = q;
-				q = q->pnext;
-			}
-		}
+	memset(&tmp, 0, sizeof(tmp));
+	mp = route_parse(nlhdr, &tmp);
+
+	if (priv->pred && !nlr_route_pred_match(priv->pred, &tmp))
+		return 0;
+
+	/* Nexthops are stored right after the route */
+	p = obj_alloc(priv->arena, sizeof(*p) + tmp.n_nhs * sizeof(*p->nhs));
+	if (!p) {
+		priv->err = 1;
+		return 0;
+	}
+	*p = tmp;
+	if (mp) {
+		p->nhs = (struct nlr_nh *)(p + 1);
+		route_parse_nhs(mp, p->nhs);
+	}
+	if (priv->end) {
+		priv->end->pnext = p;
+	} else {
+		priv->route = p;
 	}
+	priv->end = p;
 
-	return priv.route;
+	return 0;
 }
 
-int route_do(int msg_type, in_addr_t dest, int dest_plen, in_addr_t gw)
+static int route_req(struct nl_sock *sock, char *buf,
+		     struct nlr_route *filter)
 {
-	char buf[128], *p;
+	char *p;
 	struct rtmsg r;
 
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, 64);
 
-	p = nlmsg_put_hdr(buf, msg_type,
-		msg_type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK
-		: NLM_F_ACK);
+	p = nlmsg_put_hdr(buf, RTM_GETROUTE, NLM_F_DUMP);
 
 	memset(&r, 0, sizeof(r));
-
 	r.rtm_family = AF_INET;
-	r.rtm_table = RT_TABLE_MAIN;
-	r.rtm_type = RTN_UNICAST;
-	r.rtm_scope = RT_SCOPE_UNIVERSE;
-	r.rtm_protocol = RTPROT_STATIC;
-	r.rtm_dst_len = dest_plen;
+
+	/*
+	 * The kernel supports only these filters and only with strict
+	 * checking. RTA_TABLE is used as rtm_table is 8-bit.
+	 */
+	if (filter && sock->strict_chk) {
+		if (filter->proto >= 0)
+			r.rtm_protocol = filter->proto;
+		if (filter->type >= 0)
+			r.rtm_type = filter->type;
+		if (filter->table >= 0)
+			r.rtm_table = filter->table < 256 ? filter->table
+				: RT_TABLE_COMPAT;
+	}
 
 	p = add_hdr(p, &r, sizeof(r));
 
-	p = add_rta(p, RTA_DST, 4, &dest);
-	p = add_rta(p, RTA_GATEWAY, 4, &gw);
+	if (filter && sock->strict_chk) {
+		if (filter->table >= 0)
+			p = add_rta(p, RTA_TABLE, 4, &filter->table);
+		if (filter->oif > 0)
+			p = add_rta(p, RTA_OIF, 4, &filter->oif);
+	}
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
-		return -1;
-	return nl_wait_ack(&nlsock);
+	return p - buf;
 }
 
-int nlr_add_route(in_addr_t dest, int dest_plen, in_addr_t gw)
+static int route_match(struct nlr_route *r, struct nlr_route *filter)
 {
-	return route_do(RTM_NEWROUTE, dest, dest_plen, gw);
+	return !(filter->table >= 0 && r->table != filter->table
+		 || filter->type >= 0 && r->type != filter->type
+		 || filter->scope >= 0 && r->scope != filter->scope
+		 || filter->proto >= 0 && r->proto != filter->proto
+		 || filter->oif > 0 && r->oif != filter->oif
+		 || filter->gw != INADDR_NONE && r->gw != filter->gw
+		 || filter->prefsrc != INADDR_NONE && r->prefsrc
+		 != filter->prefsrc
+		 || filter->dest != INADDR_NONE && (r->dest !=
+		 filter->dest || r->dest_plen != filter->dest_plen));
 }
 
-int nlr_del_route(in_addr_t dest, int dest_plen, in_addr_t gw)
+/* Predicate of nlr_get_routes(): only @filter. */
+static void route_pred_init(struct nlr_route_pred *pred,
+			    struct nlr_route *filter)
 {
-	return route_do(RTM_DELROUTE, dest, dest_plen, gw);
+	memset(pred, 0, sizeof(*pred));
+	if (filter) {
+		pred->filter = *filter;
+		pred->filtered = 1;
+	}
 }
 
 /*
- * ip link set dev eth0 master br0
- * ip link set dev eth0 nomaster
- *
- * To delete master, set @master_idx<0.
- *
- * To add iface to bridge set it a bridge as master.
- * But! VLAN iface has no master iface!
+ * Check fields of the message header, before the route is parsed.
+ * Return 0 if the route is rejected.
  */
-int nlr_set_master(int iface_idx, int master_idx)
+static int route_pred_hdr(struct nlr_route_pred *pred, struct rtmsg *r)
 {
-	char buf[128], *p;
-	struct ifinfomsg ifi;
+	struct nlr_route *f;
 
-	memset(buf, 0, sizeof(buf));
-
-	p = nlmsg_put_hdr(buf, RTM_NEWLINK, NLM_F_ACK);
+	if (r->rtm_family != AF_INET)
+		return 0;
 
-	memset(&ifi, 0, sizeof(ifi));
-	ifi.ifi_family = AF_UNSPEC;
-	ifi.ifi_index = iface_idx;
+	if (!pred)
+		return 1;
 
-	p = add_hdr(p, &ifi, sizeof(ifi));
+	f = &pred->filter;
 
-	if (master_idx < 0)
-		master_idx = 0;
-	p = add_rta(p, IFLA_MASTER, 4, &master_idx);
+	if (pred->filtered && (f->type >= 0 && r->rtm_type != f->type
+			       || f->scope >= 0 && r->rtm_scope != f->scope
+			       || f->proto >= 0 && r->rtm_protocol != f->proto))
+		return 0;
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
-		return -1;
+	if (pred->n_protos && !(pred->protos[r->rtm_protocol >> 5]
+				& 1u << (r->rtm_protocol & 31)))
+		return 0;
 
-	return nl_wait_ack(&nlsock);
+	return 1;
 }
 
-/*
- * ip link add link eth0 name eth0.100 type vlan id 100
- */
-int nlr_add_vlan(const char *name, int master_idx, int vlan_id)
+struct nlr_route_pred *nlr_route_pred_compile(struct nlr_route *filter,
+	const int *protos, int n_protos,
+	const struct nlr_prefix_range *ranges, int n_ranges)
 {
-	char buf[128], *p;
-	struct ifinfomsg ifi;
-	static const char *vlan_type = "vlan";
-	uint16_t vlan = vlan_id;
+	struct nlr_route_pred *pred;
+	struct pred_range *q;
+	uint32_t mask;
+	int i;
+
+	pred = malloc(sizeof(*pred));
+	if (!pred) {
+		ERRNO("failed to alloc route predicate");
+		return NULL;
+	}
+	route_pred_init(pred, filter);
 
-	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < n_protos; i++) {
+		if (protos[i] < 0 || protos[i] > 255) {
+			ERROR("invalid route protocol %d", protos[i]);
+			goto err;
+		}
+		pred->protos[protos[i] >> 5] |= 1u << (protos[i] & 31);
+	}
+	pred->n_protos = n_protos;
+
+	/* One protocol: let the kernel filter by it */
+	if (n_protos == 1 && (!filter || filter->proto < 0)) {
+		if (!pred->filtered) {
+			/* All fields unset: -1 and INADDR_NONE */
+			memset(&pred->filter, 0xff, sizeof(pred->filter));
+			pred->filter.nhs = NULL;
+			pred->filter.n_nhs = 0;
+			pred->filter.pnext = NULL;
+			pred->filtered = 1;
+		}
+		pred->filter.proto = protos[0];
+	}
 
-	/* NLM_F_EXCL -- if it exists, do nothing. */
-	p = nlmsg_put_hdr(buf, RTM_NEWLINK,
-		NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK);
+	if (n_ranges) {
+		pred->ranges = malloc(n_ranges * sizeof(*pred->ranges));
+		if (!pred->ranges) {
+			ERRNO("failed to alloc route predicate");
+			goto err;
+		}
+	}
 
-	memset(&ifi, 0, sizeof(ifi));
-	ifi.ifi_family = AF_UNSPEC;
+	for (i = 0; i < n_ranges; i++) {
+		if (ranges[i].plen < 0 || ranges[i].plen > 32) {
+			ERROR("invalid prefix length %d", ranges[i].plen);
+			goto err;
+		}
+		q = &pred->ranges[i];
+		mask = ranges[i].plen ? ~0u << (32 - ranges[i].plen) : 0;
+		q->lo = ntohl(ranges[i].prefix) & mask;
+		q->hi = q->lo | ~mask;
+		q->ge = ranges[i].ge > 0 ? ranges[i].ge : ranges[i].plen;
+		q->le = ranges[i].le > 0 ? ranges[i].le : 32;
+		/* Such a range matches nothing: surely it's a mistake */
+		if (ranges[i].ge < 0 || ranges[i].le < 0
+		    || q->ge < ranges[i].plen || q->le > 32 || q->ge > q->le) {
+			ERROR("invalid prefix range ge %d le %d of /%d",
+			      ranges[i].ge, ranges[i].le, ranges[i].plen);
+			goto err;
+		}
+	}
+	pred->n_ranges = n_ranges;
 
-	p = add_hdr(p, &ifi, sizeof(ifi));
+	return pred;
 
-	p = add_rta(p, IFLA_LINK, 4, &master_idx);
+err:
+	nlr_route_pred_free(pred);
+	return NULL;
+}
+
+void nlr_route_pred_free(struct nlr_route_pred *pred)
+{
+	if (!pred)
+		return;
+	free(pred->ranges);
+	free(pred);
+}
+
+int nlr_route_pred_match(struct nlr_route_pred *pred, struct nlr_route *r)
+{
+	uint32_t dest;
+	int i;
+
+	if (pred->filtered && !route_match(r, &pred->filter))
+		return 0;
+
+	if (pred->n_protos && !(pred->protos[(r->proto & 255) >> 5]
+				& 1u << (r->proto & 31)))
+		return 0;
+
+	if (!pred->n_ranges)
+		return 1;
+
+	dest = ntohl(r->dest);
+	for (i = 0; i < pred->n_ranges; i++) {
+		if (dest >= pred->ranges[i].lo && dest <= pred->ranges[i].hi
+		    && r->dest_plen >= pred->ranges[i].ge
+		    && r->dest_plen <= pred->ranges[i].le)
+			return 1;
+	}
+
+	return 0;
+}
+
+struct nlr_route *nlr_get_routes_pred(struct nlr_route_pred *pred, int *err)
+{
+	char buf[64];
+	int len;
+	struct route_cb_priv priv;
+
+	if (err)
+		*err = -1;
+
+	len = route_req(&nlsock, buf, pred->filtered ? &pred->filter : NULL);
+
+	if (nl_send_msg(&nlsock, buf, len))
+		return NULL;
+
+	priv.route = priv.end = NULL;
+	priv.arena = arena;
+	priv.pred = pred;
+	priv.err = 0;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWROUTE, route_cb, &priv)) {
+		/* Filtered by nonexistent table or oif: no routes */
+		if ((errno == ENOENT || errno == ENODEV) && pred->filtered
+		    && nlsock.strict_chk && err)
+			*err = 0;
+		if (!priv.arena)
+			nlr_free_routes(priv.route);
+		return NULL;
+	}
+
+	if (priv.err) {
+		if (!priv.arena)
+			nlr_free_routes(priv.route);
+		return NULL;
+	}
+
+	if (err)
+		*err = 0;
+
+	return priv.route;
+}
+
+struct nlr_route *nlr_get_routes(struct nlr_route *filter, int *err)
+{
+	struct nlr_route_pred pred;
+
+	route_pred_init(&pred, filter);
+
+	return nlr_get_routes_pred(&pred, err);
+}
+
+struct route_foreach_priv {
+	struct nlr_route_pred *pred;
+	int (*cb)(struct nlr_route *, void *);
+	void *priv;
+	struct nhs_buf nhs;
+	int stopped;
+};
+
+static int route_foreach_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct route_foreach_priv *priv = (struct route_foreach_priv *)_priv;
+	struct nlr_route route;
+	struct rtattr *mp;
+
+	if (!nlhdr)
+		return 0;
+
+	if (!route_pred_hdr(priv->pred, NLMSG_DATA(nlhdr)))
+		return 0;
+
+	memset(&route, 0, sizeof(route));
+	mp = route_parse(nlhdr, &route);
+
+	if (!nlr_route_pred_match(priv->pred, &route))
+		return 0;
+
+	if (mp) {
+		route.nhs = nhs_buf_get(&priv->nhs, route.n_nhs);
+		if (!route.nhs)
+			return -1;
+		route_parse_nhs(mp, route.nhs);
+	}
+
+	if (priv->cb(&route, priv->priv)) {
+		priv->stopped = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nlr_foreach_route_pred(struct nlr_route_pred *pred,
+			   int (*cb)(struct nlr_route *, void *), void *priv)
+{
+	char buf[64];
+	int len, r;
+	struct route_foreach_priv fpriv;
+
+	len = route_req(&nlsock, buf, pred->filtered ? &pred->filter : NULL);
+
+	if (nl_send_msg(&nlsock, buf, len))
+		return -1;
+
+	fpriv.pred = pred;
+	fpriv.cb = cb;
+	fpriv.priv = priv;
+	fpriv.nhs.v = NULL;
+	fpriv.nhs.size = 0;
+	fpriv.stopped = 0;
+
+	r = nl_recv_msg(&nlsock, RTM_NEWROUTE, route_foreach_cb, &fpriv);
+	free(fpriv.nhs.v);
+	if (r) {
+		if (fpriv.stopped)
+			return 0;
+		/* Filtered by nonexistent table or oif: no routes */
+		if ((errno == ENOENT || errno == ENODEV) && pred->filtered
+		    && nlsock.strict_chk)
+			return 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nlr_foreach_route(struct nlr_route *filter,
+		      int (*cb)(struct nlr_route *, void *), void *priv)
+{
+	struct nlr_route_pred pred;
+
+	route_pred_init(&pred, filter);
+
+	return nlr_foreach_route_pred(&pred, cb, priv);
+}
+
+/*
+ * Route snapshot: struct of arrays. Scans read only the arrays they need,
+ * sequentially, without pointer chasing.
+ */
+void nlr_snap_init(struct nlr_route_snap *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+void nlr_snap_free(struct nlr_route_snap *s)
+{
+	free(s->dest);
+	free(s->plen);
+	free(s->gw);
+	free(s->oif);
+	free(s->table);
+	free(s->proto);
+	nlr_snap_init(s);
+}
+
+/* (Re)allocate all the arrays for @size routes. */
+static int snap_alloc(struct nlr_route_snap *s, int size)
+{
+	void *p;
+
+#define SNAP_RESIZE(a) do { \
+	p = realloc(s->a, size * sizeof(*s->a)); \
+	if (!p) \
+		goto err; \
+	s->a = p; \
+} while (0)
+
+	SNAP_RESIZE(dest);
+	SNAP_RESIZE(plen);
+	SNAP_RESIZE(gw);
+	SNAP_RESIZE(oif);
+	SNAP_RESIZE(table);
+	SNAP_RESIZE(proto);
+	s->size = size;
+
+	return 0;
+
+err:
+	ERRNO("failed to alloc route snapshot of %d routes", size);
+	return -1;
+#undef SNAP_RESIZE
+}
+
+struct snap_add_priv {
+	struct nlr_route_snap *s;
+	int err;
+};
+
+static int snap_add_cb(struct nlr_route *r, void *_priv)
+{
+	struct snap_add_priv *priv = (struct snap_add_priv *)_priv;
+	struct nlr_route_snap *s = priv->s;
+	int i = s->n;
+
+	if (i == s->size && snap_alloc(s, s->size ? s->size * 2 : 1024)) {
+		priv->err = 1;
+		return -1;
+	}
+
+	s->dest[i] = ntohl(r->dest);
+	s->plen[i] = r->dest_plen;
+	s->gw[i] = r->gw;
+	s->oif[i] = r->oif;
+	s->table[i] = r->table;
+	s->proto[i] = r->proto;
+	s->n++;
+
+	return 0;
+}
+
+int nlr_snap_load(struct nlr_route_snap *s, struct nlr_route_pred *pred)
+{
+	struct nlr_route_pred all;
+	struct snap_add_priv priv;
+
+	s->n = 0;
+	s->sorted = 0;
+
+	if (!pred) {
+		route_pred_init(&all, NULL);
+		pred = &all;
+	}
+
+	priv.s = s;
+	priv.err = 0;
+
+	if (nlr_foreach_route_pred(pred, snap_add_cb, &priv) || priv.err) {
+		s->n = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+#define SNAP_IDX_BITS 26 /* Row index in the sort key */
+#define SNAP_RADIX_BITS 11
+
+/*
+ * Sort by (dest, plen): LSD radix sort of 64-bit keys
+ * dest << 32 | plen << 26 | row, then the arrays are permuted.
+ */
+int nlr_snap_sort(struct nlr_route_snap *s)
+{
+	uint64_t *key, *tmp, *t;
+	unsigned cnt[1 << SNAP_RADIX_BITS], sum, c;
+	int i, shift, n = s->n, r = -1;
+	struct nlr_route_snap sorted;
+
+	if (s->sorted || n < 2) {
+		s->sorted = 1;
+		return 0;
+	}
+
+	if (n >= 1 << SNAP_IDX_BITS) {
+		ERROR("too many routes to sort: %d", n);
+		return -1;
+	}
+
+	nlr_snap_init(&sorted);
+	key = malloc(n * sizeof(*key));
+	tmp = malloc(n * sizeof(*tmp));
+	if (!key || !tmp) {
+		ERRNO("failed to alloc buffers to sort %d routes", n);
+		goto out;
+	}
+	if (snap_alloc(&sorted, n))
+		goto out;
+
+	for (i = 0; i < n; i++)
+		key[i] = (uint64_t)s->dest[i] << 32
+			| (uint64_t)s->plen[i] << SNAP_IDX_BITS | i;
+
+	for (shift = SNAP_IDX_BITS; shift < 64; shift += SNAP_RADIX_BITS) {
+		memset(cnt, 0, sizeof(cnt));
+		for (i = 0; i < n; i++)
+			cnt[(key[i] >> shift) & ((1 << SNAP_RADIX_BITS) - 1)]++;
+		for (i = 0, sum = 0; i < 1 << SNAP_RADIX_BITS; i++) {
+			c = cnt[i];
+			cnt[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			tmp[cnt[(key[i] >> shift)
+				& ((1 << SNAP_RADIX_BITS) - 1)]++] = key[i];
+		t = key;
+		key = tmp;
+		tmp = t;
+	}
+
+	for (i = 0; i < n; i++) {
+		c = key[i] & ((1 << SNAP_IDX_BITS) - 1);
+		sorted.dest[i] = s->dest[c];
+		sorted.plen[i] = s->plen[c];
+		sorted.gw[i] = s->gw[c];
+		sorted.oif[i] = s->oif[c];
+		sorted.table[i] = s->table[c];
+		sorted.proto[i] = s->proto[c];
+	}
+
+	sorted.n = n;
+	sorted.sorted = 1;
+	nlr_snap_free(s);
+	*s = sorted;
+	r = 0;
+
+out:
+	if (r)
+		nlr_snap_free(&sorted);
+	free(key);
+	free(tmp);
+	return r;
+}
+
+/* The first row with (dest, plen) >= (@dest, @plen). */
+static int snap_lower_bound(struct nlr_route_snap *s, uint32_t dest, int plen)
+{
+	int lo = 0, hi = s->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s->dest[mid] < dest
+		    || s->dest[mid] == dest && s->plen[mid] < plen)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int nlr_snap_find(struct nlr_route_snap *s, in_addr_t dest, int plen)
+{
+	int i;
+
+	if (!s->sorted) {
+		ERROR("snapshot isn't sorted");
+		return -1;
+	}
+
+	i = snap_lower_bound(s, ntohl(dest), plen);
+	if (i < s->n && s->dest[i] == ntohl(dest) && s->plen[i] == plen)
+		return i;
+
+	return -1;
+}
+
+int nlr_snap_within(struct nlr_route_snap *s, in_addr_t prefix, int plen,
+		    int *first)
+{
+	uint32_t mask, lo, hi;
+	int i, j;
+
+	if (!s->sorted) {
+		ERROR("snapshot isn't sorted");
+		return -1;
+	}
+
+	mask = plen ? ~0u << (32 - plen) : 0;
+	lo = ntohl(prefix) & mask;
+	hi = lo | ~mask;
+
+	/* Routes with dest=lo and shorter prefix are not inside */
+	i = snap_lower_bound(s, lo, plen);
+	if (hi == 0xffffffff)
+		j = s->n;
+	else
+		j = snap_lower_bound(s, hi + 1, 0);
+
+	if (first)
+		*first = i;
+
+	return j - i;
+}
+
+/*
+ * No branches in the loop: the compiler vectorizes the compares, a row
+ * index is always stored and the count is advanced only on a match.
+ */
+int nlr_snap_select(struct nlr_route_snap *s, int table, int proto, int oif,
+		    int *rows)
+{
+	unsigned any_table = table < 0, any_proto = proto < 0,
+		 any_oif = oif < 0;
+	int i, n = 0;
+
+	for (i = 0; i < s->n; i++) {
+		rows[n] = i;
+		n += (any_table | (s->table[i] == (unsigned)table))
+		     & (any_proto | (s->proto[i] == proto))
+		     & (any_oif | (s->oif[i] == oif));
+	}
+
+	return n;
+}
+
+struct route_lookup_cb_priv {
+	struct nlr_route *route;
+	int found;
+};
+
+static int route_lookup_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct route_lookup_cb_priv *priv = (struct route_lookup_cb_priv *)_priv;
+
+	if (!nlhdr)
+		return 0;
+
+	/* The kernel returns only the selected path of a multipath route */
+	route_parse(nlhdr, priv->route);
+	priv->route->n_nhs = 0;
+	priv->found = 1;
+
+	return 0;
+}
+
+/*
+ * ip route get ADDR
+ *
+ * The kernel does the lookup itself and returns the resolved route:
+ * one request and one reply instead of dumping the whole table.
+ */
+int nlr_route_lookup(in_addr_t dest, struct nlr_route *route)
+{
+	char buf[64], *p;
+	struct rtmsg r;
+	struct route_lookup_cb_priv priv;
+
+	memset(buf, 0, sizeof(buf));
+
+	p = nlmsg_put_hdr(buf, RTM_GETROUTE, 0);
+
+	memset(&r, 0, sizeof(r));
+	r.rtm_family = AF_INET;
+	r.rtm_dst_len = 32;
+
+	p = add_hdr(p, &r, sizeof(r));
+	p = add_rta(p, RTA_DST, 4, &dest);
+
+	if (nl_send_msg(&nlsock, buf, p - buf))
+		return -1;
+
+	memset(route, 0, sizeof(*route));
+	priv.route = route;
+	priv.found = 0;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWROUTE, route_lookup_cb, &priv))
+		return -1;
+
+	return priv.found ? 0 : -1;
+}
+
+/*
+ * Asynchronous dumps use their own non-blocking socket, so they don't
+ * interfere with blocking calls.
+ */
+static int async_open(void)
+{
+	if (NL_IS_OPEN(&asock))
+		return 0;
+
+	if (nl_open(&asock, NETLINK_ROUTE))
+		return -1;
+
+	if (nl_set_nonblock(&asock, 1)) {
+		nl_close(&asock);
+		return -1;
+	}
+
+	return 0;
+}
+
+int nlr_async_fd(void)
+{
+	return async_open() ? -1 : asock.sock;
+}
+
+int nlr_async_dispatch(void)
+{
+	if (!NL_IS_OPEN(&asock))
+		return 0;
+
+	return nl_dispatch(&asock);
+}
+
+struct iface_async {
+	struct iface_cb_priv priv;
+	void (*done)(struct nlr_iface *, int, void *);
+	void *done_priv;
+};
+
+static void iface_async_done(int err, void *_async)
+{
+	struct iface_async *async = (struct iface_async *)_async;
+
+	/* No such iface -- it's not an error, just empty result */
+	if (err == -ENODEV)
+		err = 0;
+	if (!err && async->priv.err)
+		err = -ENOMEM;
+	if (err) {
+		if (!async->priv.arena)
+			nlr_iface_free(async->priv.iface);
+		async->priv.iface = NULL;
+	}
+
+	async->done(async->priv.iface, err, async->done_priv);
+	free(async);
+}
+
+int nlr_iface_async(int iface_idx,
+		    void (*done)(struct nlr_iface *, int, void *), void *priv)
+{
+	char buf[128];
+	int len;
+	struct iface_async *async;
+
+	if (async_open())
+		return -1;
+
+	len = iface_req(buf, iface_idx, NULL, -1);
+	if (len < 0)
+		return -1;
+
+	async = calloc(1, sizeof(*async));
+	if (!async) {
+		ERRNO("failed to alloc async request");
+		return -1;
+	}
+
+	async->priv.iface_idx = iface_idx;
+	async->priv.master_idx = -1;
+	async->priv.arena = arena;
+	async->done = done;
+	async->done_priv = priv;
+
+	if (nl_submit(&asock, buf, len, iface_cb, iface_async_done, async)) {
+		free(async);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct addr_async {
+	struct addr_cb_priv priv;
+	void (*done)(struct nlr_addr *, int, void *);
+	void *done_priv;
+};
+
+static void addr_async_done(int err, void *_async)
+{
+	struct addr_async *async = (struct addr_async *)_async;
+
+	/* Filtered by nonexistent iface: no addresses */
+	if (err == -ENODEV)
+		err = 0;
+	if (!err && async->priv.err)
+		err = -ENOMEM;
+	if (err) {
+		if (!async->priv.arena)
+			nlr_addr_free(async->priv.addr);
+		async->priv.addr = NULL;
+	}
+
+	async->done(async->priv.addr, err, async->done_priv);
+	free(async);
+}
+
+int nlr_get_addr_async(int iface_idx,
+		       void (*done)(struct nlr_addr *, int, void *), void *priv)
+{
+	char buf[64];
+	int len;
+	struct addr_async *async;
+
+	if (async_open())
+		return -1;
+
+	len = addr_req(&asock, buf, iface_idx);
+
+	async = calloc(1, sizeof(*async));
+	if (!async) {
+		ERRNO("failed to alloc async request");
+		return -1;
+	}
+
+	async->priv.iface_idx = iface_idx;
+	async->priv.arena = arena;
+	async->done = done;
+	async->done_priv = priv;
+
+	if (nl_submit(&asock, buf, len, addr_cb, addr_async_done, async)) {
+		free(async);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct route_async {
+	struct route_cb_priv priv;
+	struct nlr_route_pred pred;
+	void (*done)(struct nlr_route *, int, void *);
+	void *done_priv;
+};
+
+static void route_async_done(int err, void *_async)
+{
+	struct route_async *async = (struct route_async *)_async;
+
+	/* Filtered by nonexistent table or oif: no routes */
+	if ((err == -ENOENT || err == -ENODEV) && async->pred.filtered
+	    && asock.strict_chk)
+		err = 0;
+	if (!err && async->priv.err)
+		err = -ENOMEM;
+	if (err) {
+		if (!async->priv.arena)
+			nlr_free_routes(async->priv.route);
+		async->priv.route = NULL;
+	}
+
+	async->done(async->priv.route, err, async->done_priv);
+	free(async);
+}
+
+int nlr_get_routes_async(struct nlr_route *filter,
+			 void (*done)(struct nlr_route *, int, void *),
+			 void *priv)
+{
+	char buf[64];
+	int len;
+	struct route_async *async;
+
+	if (async_open())
+		return -1;
+
+	len = route_req(&asock, buf, filter);
+
+	async = calloc(1, sizeof(*async));
+	if (!async) {
+		ERRNO("failed to alloc async request");
+		return -1;
+	}
+
+	route_pred_init(&async->pred, filter);
+	async->priv.pred = &async->pred;
+	async->priv.arena = arena;
+	async->done = done;
+	async->done_priv = priv;
+
+	if (nl_submit(&asock, buf, len, route_cb, route_async_done, async)) {
+		free(async);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Build RTM_NEWROUTE/RTM_DELROUTE message for @route into @buf (at least
+ * ROUTE_MSG_SIZE bytes), return its length. Unset fields (see
+ * nlr_add_routes()) get defaults on adding and match any route on deleting.
+ */
+#define ROUTE_MSG_SIZE (128 + NLR_MAX_NHS * (sizeof(struct rtnexthop) \
+					      + RTA_SPACE(4)))
+
+static int route_msg(char *buf, int msg_type, int flags, const void *obj)
+{
+	const struct nlr_route *route = obj;
+	char *p;
+	struct rtmsg r;
+	struct rtattr *mp;
+	struct rtnexthop *nh;
+	const struct nlr_nh *v;
+	int add = msg_type == RTM_NEWROUTE, table, i;
+
+	memset(buf, 0, ROUTE_MSG_SIZE);
+
+	p = nlmsg_put_hdr(buf, msg_type, flags | NLM_F_ACK);
+
+	memset(&r, 0, sizeof(r));
+
+	table = route->table >= 0 ? route->table : RT_TABLE_MAIN;
+
+	r.rtm_family = AF_INET;
+	r.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+	r.rtm_dst_len = route->dest_plen;
+	if (route->type >= 0)
+		r.rtm_type = route->type;
+	else if (add)
+		r.rtm_type = RTN_UNICAST;
+	if (route->scope >= 0)
+		r.rtm_scope = route->scope;
+	else if (add)
+		r.rtm_scope = RT_SCOPE_UNIVERSE;
+	else
+		r.rtm_scope = RT_SCOPE_NOWHERE; /* Any */
+	if (route->proto >= 0)
+		r.rtm_protocol = route->proto;
+	else if (add)
+		r.rtm_protocol = RTPROT_STATIC;
+
+	p = add_hdr(p, &r, sizeof(r));
+
+	if (route->dest_plen)
+		p = add_rta(p, RTA_DST, 4, (void *)&route->dest);
+	if (table >= 256)
+		p = add_rta(p, RTA_TABLE, 4, &table);
+	if (route->prefsrc && route->prefsrc != INADDR_NONE)
+		p = add_rta(p, RTA_PREFSRC, 4, (void *)&route->prefsrc);
+	if (route->metrics >= 0)
+		p = add_rta(p, RTA_PRIORITY, 4, (void *)&route->metrics);
+
+	/*
+	 * The kernel rejects a nexthop id together with gw/oif/multipath,
+	 * but dumps nh routes with them (nexthop_compat_mode).
+	 */
+	if (route->nh_id > 0) {
+		p = add_rta(p, RTA_NH_ID, 4, (void *)&route->nh_id);
+		return p - buf;
+	}
+
+	if (route->gw && route->gw != INADDR_NONE)
+		p = add_rta(p, RTA_GATEWAY, 4, (void *)&route->gw);
+	if (route->oif > 0)
+		p = add_rta(p, RTA_OIF, 4, (void *)&route->oif);
+
+	if (route->n_nhs > 0) {
+		mp = (struct rtattr *)p;
+		mp->rta_type = RTA_MULTIPATH;
+		nh = RTA_DATA(mp);
+		for (i = 0; i < route->n_nhs; i++) {
+			v = &route->nhs[i];
+			nh->rtnh_len = sizeof(*nh);
+			nh->rtnh_flags = v->flags & RTNH_F_ONLINK;
+			nh->rtnh_hops = v->weight > 0 ? v->weight - 1 : 0;
+			nh->rtnh_ifindex = v->oif > 0 ? v->oif : 0;
+			if (v->gw && v->gw != INADDR_NONE) {
+				add_rta((char *)RTNH_DATA(nh), RTA_GATEWAY, 4,
+					(void *)&v->gw);
+				nh->rtnh_len += RTA_SPACE(4);
+			}
+			nh = RTNH_NEXT(nh);
+		}
+		mp->rta_len = (char *)nh - p;
+		p = (char *)nh;
+	}
+
+	return p - buf;
+}
+
+int route_do(int msg_type, in_addr_t dest, int dest_plen, in_addr_t gw)
+{
+	char buf[ROUTE_MSG_SIZE];
+	struct nlr_route r;
+
+	memset(&r, 0, sizeof(r));
+	r.table = RT_TABLE_MAIN;
+	r.type = RTN_UNICAST;
+	r.scope = RT_SCOPE_UNIVERSE;
+	r.proto = RTPROT_STATIC;
+	r.metrics = -1;
+	r.dest = dest;
+	r.dest_plen = dest_plen;
+	r.gw = gw;
+
+	return do_request(buf, route_msg(buf, msg_type,
+		msg_type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_EXCL : 0, &r));
+}
+
+int nlr_add_route(in_addr_t dest, int dest_plen, in_addr_t gw)
+{
+	return route_do(RTM_NEWROUTE, dest, dest_plen, gw);
+}
+
+int nlr_del_route(in_addr_t dest, int dest_plen, in_addr_t gw)
+{
+	return route_do(RTM_DELROUTE, dest, dest_plen, gw);
+}
+
+/*
+ * Send a message per object of @v (@n objects of @obj_size bytes) built by
+ * @build into a buffer of MSG_MAX_SIZE. Messages are queued and sent by
+ * chunks, so the batch buffer doesn't grow with the number of objects.
+ * Result of the i-th object is stored in @errs[i]. Return number of
+ * failed objects or -1.
+ */
+#define MSG_MAX_SIZE ROUTE_MSG_SIZE
+#define BATCH_CHUNK 1024
+
+/* Objects from @i on never reached the kernel, as in nl_batch_send(). */
+static void objs_cancel(int *errs, int i, int n)
+{
+	for (; errs && i < n; i++)
+		errs[i] = -ECANCELED;
+}
+
+static int objs_do(int (*build)(char *, int, int, const void *),
+		   int msg_type, int flags, const void *v, int obj_size,
+		   int n, int *errs)
+{
+	char buf[MSG_MAX_SIZE];
+	struct nl_batch b;
+	int i, cnt, r, nerr = 0;
+
+	/*
+	 * Inside nlr_batch_begin()/nlr_batch_end() just queue them: queued
+	 * ones get 0, their results are reported by nlr_batch_end().
+	 */
+	if (batching) {
+		for (i = 0; i < n; i++) {
+			if (do_request(buf, build(buf, msg_type, flags,
+				       (char *)v + i * obj_size))) {
+				objs_cancel(errs, i, n);
+				return -1;
+			}
+			if (errs)
+				errs[i] = 0;
+		}
+		return 0;
+	}
+
+	nl_batch_init(&b);
+
+	for (i = 0; i < n; i += cnt) {
+		cnt = n - i < BATCH_CHUNK ? n - i : BATCH_CHUNK;
+
+		nl_batch_reset(&b);
+		for (r = 0; r < cnt; r++) {
+			if (nl_batch_add(&b, buf, build(buf, msg_type, flags,
+					 (char *)v + (i + r) * obj_size)) < 0) {
+				nl_batch_free(&b);
+				objs_cancel(errs, i, n);
+				return -1;
+			}
+		}
+
+		r = nl_batch_send(&nlsock, &b, errs ? errs + i : NULL);
+		if (r < 0) {
+			nl_batch_free(&b);
+			objs_cancel(errs, i + cnt, n);
+			return -1;
+		}
+		nerr += r;
+	}
+
+	nl_batch_free(&b);
+
+	return nerr;
+}
+
+static int routes_do(int msg_type, int flags, const struct nlr_route *v,
+		     int n, int *errs)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (v[i].n_nhs > NLR_MAX_NHS) {
+			ERROR("route #%d has more than %d nexthops", i,
+			      NLR_MAX_NHS);
+			objs_cancel(errs, 0, n);
+			return -1;
+		}
+	}
+
+	return objs_do(route_msg, msg_type, flags, v, sizeof(*v), n, errs);
+}
+
+int nlr_add_routes(const struct nlr_route *v, int n, int *errs)
+{
+	return routes_do(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, v, n, errs);
+}
+
+int nlr_del_routes(const struct nlr_route *v, int n, int *errs)
+{
+	return routes_do(RTM_DELROUTE, 0, v, n, errs);
+}
+
+/*
+ * Sync: routes of both sets are sorted by the kernel key of a route in
+ * a table (dest, prefix length, metric) and merged.
+ */
+struct sync_cur {
+	struct nlr_route *v;
+	int n, size;
+	int err; /* The walk was stopped by a failure */
+};
+
+static int sync_cur_cb(struct nlr_route *r, void *_cur)
+{
+	struct sync_cur *cur = _cur;
+	struct nlr_route *v;
+	int size;
+
+	if (cur->n == cur->size) {
+		size = cur->size ? cur->size * 2 : 1024;
+		v = realloc(cur->v, size * sizeof(*v));
+		if (!v) {
+			ERRNO("failed to alloc %d routes", size);
+			cur->err = 1;
+			return -1;
+		}
+		cur->v = v;
+		cur->size = size;
+	}
+
+	cur->v[cur->n] = *r;
+
+	/* Nexthops of the visitor are valid only during the call */
+	if (r->n_nhs) {
+		v = &cur->v[cur->n];
+		v->nhs = malloc(r->n_nhs * sizeof(*v->nhs));
+		if (!v->nhs) {
+			ERRNO("failed to alloc nexthops");
+			cur->err = 1;
+			return -1;
+		}
+		memcpy(v->nhs, r->nhs, r->n_nhs * sizeof(*v->nhs));
+	}
+	cur->n++;
+
+	return 0;
+}
+
+static int route_key_cmp(const void *_a, const void *_b)
+{
+	const struct nlr_route *a = _a, *b = _b;
+	uint32_t da = ntohl(a->dest), db = ntohl(b->dest);
+
+	if (da != db)
+		return da < db ? -1 : 1;
+	if (a->dest_plen != b->dest_plen)
+		return a->dest_plen - b->dest_plen;
+	if ((unsigned)a->metrics != (unsigned)b->metrics)
+		return (unsigned)a->metrics < (unsigned)b->metrics ? -1 : 1;
+	return 0;
+}
+
+/* Desired route @d is normalized, so unset fields are only @oif or @scope. */
+static int route_same(const struct nlr_route *d, const struct nlr_route *c)
+{
+	int i;
+
+	/* Dumps show gw and oif of the nexthop object too */
+	if (d->nh_id > 0 || c->nh_id)
+		return d->nh_id == c->nh_id && d->type == c->type;
+
+	if (d->n_nhs != c->n_nhs)
+		return 0;
+	for (i = 0; i < d->n_nhs; i++) {
+		if (d->nhs[i].gw != c->nhs[i].gw
+		    || d->nhs[i].oif > 0 && d->nhs[i].oif != c->nhs[i].oif
+		    || (d->nhs[i].weight > 0 ? d->nhs[i].weight : 1)
+		    != c->nhs[i].weight)
+			return 0;
+	}
+
+	return d->type == c->type && d->gw == c->gw
+		&& d->prefsrc == c->prefsrc
+		&& (d->oif <= 0 || d->oif == c->oif)
+		&& (d->scope < 0 || d->scope == c->scope);
+}
+
+static int sync_apply(int msg_type, int flags, struct nlr_route *v, int n,
+		      int *ok, int *failed)
+{
+	int *errs, r;
+
+	if (!n)
+		return 0;
+
+	errs = malloc(n * sizeof(*errs));
+	if (!errs) {
+		ERRNO("failed to alloc %d results", n);
+		return -1;
+	}
+
+	r = routes_do(msg_type, flags, v, n, errs);
+	free(errs);
+	if (r < 0)
+		return -1;
+
+	*ok += n - r;
+	*failed += r;
+
+	return r;
+}
+
+int nlr_sync_routes(const struct nlr_route *desired, int n, int table,
+		    int proto, struct nlr_sync_stats *stats)
+{
+	struct sync_cur cur;
+	struct nlr_route filter, *want = NULL, *add = NULL, *repl = NULL,
+			 *del = NULL, *d;
+	struct nlr_sync_stats st;
+	int i, j, k, m, n_add = 0, n_repl = 0, n_del = 0, r = -1, nerr = 0;
+
+	memset(&st, 0, sizeof(st));
+	memset(&cur, 0, sizeof(cur));
+
+	if (batching) {
+		ERROR("can't sync routes inside a batch");
+		return -1;
+	}
+
+	memset(&filter, 0xff, sizeof(filter));
+	filter.nhs = NULL;
+	filter.n_nhs = 0;
+	filter.pnext = NULL;
+	filter.table = table;
+	filter.proto = proto;
+	if (nlr_foreach_route(&filter, sync_cur_cb, &cur) || cur.err)
+		goto out;
+
+	want = malloc((n + 1) * sizeof(*want));
+	add = malloc((n + 1) * sizeof(*add));
+	repl = malloc((n + 1) * sizeof(*repl));
+	del = malloc((cur.n + 1) * sizeof(*del));
+	if (!want || !add || !repl || !del) {
+		ERRNO("failed to alloc sync sets");
+		goto out;
+	}
+
+	/* Normalize desired routes, so they compare with dumped ones */
+	for (i = 0; i < n; i++) {
+		d = &want[i];
+		*d = desired[i];
+		d->table = table;
+		d->proto = proto;
+		d->pnext = NULL;
+		if (d->type < 0)
+			d->type = RTN_UNICAST;
+		if (d->metrics < 0)
+			d->metrics = 0;
+		if (d->nh_id < 0)
+			d->nh_id = 0;
+		if (d->n_nhs < 0)
+			d->n_nhs = 0;
+		if (d->gw == INADDR_NONE)
+			d->gw = 0;
+		if (d->prefsrc == INADDR_NONE)
+			d->prefsrc = 0;
+		if (!d->dest_plen)
+			d->dest = 0;
+	}
+
+	qsort(want, n, sizeof(*want), route_key_cmp);
+	qsort(cur.v, cur.n, sizeof(*cur.v), route_key_cmp);
+
+	for (i = 0, j = 0; i < n || j < cur.n; ) {
+		if (i == n)
+			k = 1;
+		else if (j == cur.n)
+			k = -1;
+		else
+			k = route_key_cmp(&want[i], &cur.v[j]);
+
+		if (k < 0) {
+			add[n_add++] = want[i];
+		} else if (k > 0) {
+			del[n_del++] = cur.v[j++];
+			continue;
+		} else {
+			if (route_same(&want[i], &cur.v[j]))
+				st.unchanged++;
+			else
+				repl[n_repl++] = want[i];
+			j++;
+		}
+
+		/* Skip duplicates, only one of them is used */
+		for (m = i++; i < n && !route_key_cmp(&want[i], &want[m]); i++)
+			;
+	}
+
+	DEBUG("sync table %d: %d to add, %d to replace, %d to delete",
+	      table, n_add, n_repl, n_del);
+
+	/* Deletions are the last, so traffic has somewhere to go */
+	if ((k = sync_apply(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, repl,
+			    n_repl, &st.replaced, &st.failed)) < 0)
+		goto out;
+	nerr += k;
+	if ((k = sync_apply(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, add,
+			    n_add, &st.added, &st.failed)) < 0)
+		goto out;
+	nerr += k;
+	if ((k = sync_apply(RTM_DELROUTE, 0, del, n_del, &st.deleted,
+			    &st.failed)) < 0)
+		goto out;
+	nerr += k;
+
+	r = nerr;
+
+out:
+	if (stats)
+		*stats = st;
+	for (i = 0; i < cur.n; i++)
+		free(cur.v[i].nhs);
+	free(cur.v);
+	free(want);
+	free(add);
+	free(repl);
+	free(del);
+
+	return r;
+}
+
+/*
+ * Nexthop objects (Linux 5.3+): routes refer to them by id, so changing
+ * a nexthop changes all its routes at once.
+ */
+struct nexthop_cb_priv {
+	struct nlr_nexthop *nh;
+	struct nl_arena *arena;
+	int err;
+};
+
+static int nexthop_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct nexthop_cb_priv *priv = (struct nexthop_cb_priv *)_priv;
+	struct nhmsg *nhm;
+	struct rtattr *rta;
+	struct nexthop_grp *grp = NULL;
+	struct nlr_nexthop tmp, *nh;
+	int n, i;
+
+	if (!nlhdr || priv->err)
+		return 0;
+
+	nhm = NLMSG_DATA(nlhdr);
+
+	if (nhm->nh_family == AF_INET6)
+		return 0;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.proto = nhm->nh_protocol;
+
+	for (rta = (struct rtattr *)((char *)nhm + NLMSG_ALIGN(sizeof(*nhm))),
+	     n = NLMSG_PAYLOAD(nlhdr, sizeof(*nhm));
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		switch (rta->rta_type) {
+		case NHA_ID:
+			tmp.id = *(uint32_t *)RTA_DATA(rta);
+			break;
+		case NHA_GROUP:
+			grp = RTA_DATA(rta);
+			tmp.n_group = RTA_PAYLOAD(rta) / sizeof(*grp);
+			break;
+		case NHA_BLACKHOLE:
+			tmp.blackhole = 1;
+			break;
+		case NHA_OIF:
+			tmp.oif = *(uint32_t *)RTA_DATA(rta);
+			break;
+		case NHA_GATEWAY:
+			if (RTA_PAYLOAD(rta) == 4)
+				tmp.gw = *(in_addr_t *)RTA_DATA(rta);
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Members are stored right after the struct */
+	nh = obj_alloc(priv->arena, sizeof(*nh)
+		       + tmp.n_group * sizeof(*nh->group));
+	if (!nh) {
+		ERRNO("failed to alloc nlr_nexthop");
+		priv->err = 1;
+		return 0;
+	}
+
+	*nh = tmp;
+	if (nh->n_group) {
+		nh->group = (struct nlr_nexthop_grp *)(nh + 1);
+		for (i = 0; i < nh->n_group; i++) {
+			nh->group[i].id = grp[i].id;
+			nh->group[i].weight = grp[i].weight + 1;
+		}
+	}
+
+	nh->pnext = priv->nh;
+	priv->nh = nh;
+
+	return 0;
+}
+
+void nlr_nexthop_free(struct nlr_nexthop *nh)
+{
+	struct nlr_nexthop *p;
+
+	while (nh) {
+		p = nh->pnext;
+		free(nh);
+		nh = p;
+	}
+}
+
+struct nlr_nexthop *nlr_get_nexthops(int *err)
+{
+	char buf[64], *p;
+	struct nhmsg nhm;
+	struct nexthop_cb_priv priv;
+
+	if (err)
+		*err = -1;
+
+	memset(buf, 0, sizeof(buf));
+
+	p = nlmsg_put_hdr(buf, RTM_GETNEXTHOP, NLM_F_DUMP);
+
+	memset(&nhm, 0, sizeof(nhm));
+	nhm.nh_family = AF_UNSPEC; /* Groups have no family */
+
+	p = add_hdr(p, &nhm, sizeof(nhm));
+
+	if (nl_send_msg(&nlsock, buf, p - buf))
+		return NULL;
+
+	priv.nh = NULL;
+	priv.arena = arena;
+	priv.err = 0;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWNEXTHOP, nexthop_cb, &priv)
+	    || priv.err) {
+		if (!priv.arena)
+			nlr_nexthop_free(priv.nh);
+		return NULL;
+	}
+
+	if (err)
+		*err = 0;
+
+	return priv.nh;
+}
+
+static int nexthop_do(int msg_type, int flags, struct nlr_nexthop *nh)
+{
+	char *buf, *p;
+	struct nhmsg nhm;
+	struct rtattr *rta;
+	struct nexthop_grp *grp;
+	int len, i, r;
+	uint32_t id = nh->id, oif = nh->oif;
+
+	if (nh->n_group > 0 && !nh->group) {
+		ERROR("no members of nexthop group %d", nh->id);
+		return -1;
+	}
+
+	len = 128 + nh->n_group * RTA_ALIGN(sizeof(*grp));
+	buf = calloc(1, len);
+	if (!buf) {
+		ERRNO("failed to alloc nexthop msg");
+		return -1;
+	}
+
+	p = nlmsg_put_hdr(buf, msg_type, flags | NLM_F_ACK);
+
+	memset(&nhm, 0, sizeof(nhm));
+	if (msg_type == RTM_NEWNEXTHOP) {
+		/* Groups and blackholes are family-less */
+		nhm.nh_family = nh->n_group > 0 || nh->blackhole ? AF_UNSPEC
+			: AF_INET;
+		nhm.nh_protocol = nh->proto >= 0 ? nh->proto : RTPROT_STATIC;
+	}
+
+	p = add_hdr(p, &nhm, sizeof(nhm));
+
+	p = add_rta(p, NHA_ID, 4, &id);
+
+	if (msg_type == RTM_NEWNEXTHOP) {
+		if (nh->n_group > 0) {
+			/* Filled in place, it can be big */
+			rta = (struct rtattr *)p;
+			rta->rta_type = NHA_GROUP;
+			rta->rta_len = RTA_LENGTH(nh->n_group * sizeof(*grp));
+			grp = RTA_DATA(rta);
+			for (i = 0; i < nh->n_group; i++) {
+				grp[i].id = nh->group[i].id;
+				grp[i].weight = nh->group[i].weight > 0
+					? nh->group[i].weight - 1 : 0;
+			}
+			p += RTA_ALIGN(rta->rta_len);
+		} else if (nh->blackhole) {
+			p = add_rta(p, NHA_BLACKHOLE, 0, NULL);
+		} else {
+			if (nh->oif > 0)
+				p = add_rta(p, NHA_OIF, 4, &oif);
+			if (nh->gw && nh->gw != INADDR_NONE)
+				p = add_rta(p, NHA_GATEWAY, 4,
+					    (void *)&nh->gw);
+		}
+	}
+
+	r = do_request(buf, p - buf);
+	free(buf);
+
+	return r;
+}
+
+int nlr_add_nexthop(struct nlr_nexthop *nh)
+{
+	return nexthop_do(RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_EXCL, nh);
+}
+
+int nlr_replace_nexthop(struct nlr_nexthop *nh)
+{
+	return nexthop_do(RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_REPLACE, nh);
+}
+
+int nlr_del_nexthop(int id)
+{
+	struct nlr_nexthop nh;
+
+	memset(&nh, 0, sizeof(nh));
+	nh.id = id;
+
+	return nexthop_do(RTM_DELNEXTHOP, 0, &nh);
+}
+
+/*
+ * ip link set dev eth0 master br0
+ * ip link set dev eth0 nomaster
+ *
+ * To delete master, set @master_idx<0.
+ *
+ * To add iface to bridge set it a bridge as master.
+ * But! VLAN iface has no master iface!
+ */
+int nlr_set_master(int iface_idx, int master_idx)
+{
+	char buf[128], *p;
+	struct ifinfomsg ifi;
+
+	memset(buf, 0, sizeof(buf));
+
+	p = nlmsg_put_hdr(buf, RTM_NEWLINK, NLM_F_ACK);
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = iface_idx;
+
+	p = add_hdr(p, &ifi, sizeof(ifi));
+
+	if (master_idx < 0)
+		master_idx = 0;
+	p = add_rta(p, IFLA_MASTER, 4, &master_idx);
+
+	return do_request(buf, p - buf);
+}
+
+/*
+ * ip link add link eth0 name eth0.100 type vlan id 100
+ */
+int nlr_add_vlan(const char *name, int master_idx, int vlan_id)
+{
+	char buf[128], *p;
+	struct ifinfomsg ifi;
+	static const char *vlan_type = "vlan";
+	uint16_t vlan = vlan_id;
+
+	memset(buf, 0, sizeof(buf));
+
+	/* NLM_F_EXCL -- if it exists, do nothing. */
+	p = nlmsg_put_hdr(buf, RTM_NEWLINK,
+		NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK);
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+
+	p = add_hdr(p, &ifi, sizeof(ifi));
+
+	p = add_rta(p, IFLA_LINK, 4, &master_idx);
 	p = add_rta(p, IFLA_IFNAME, strlen(name) + 1, (char *)name);
 	struct rtattr *linkinfo = (struct rtattr *)p;
 	p = add_rta(p, IFLA_LINKINFO, 0, NULL);
@@ -817,67 +3057,1239 @@ int nlr_add_vlan(const char *name, int master_idx, int vlan_id)
 	linkinfo_data->rta_len = p - (char *)linkinfo_data;
 	linkinfo->rta_len = p - (char *)linkinfo;
 
+	return do_request(buf, p - buf);
+}
+
+/*
+ * ip link add name br0 type bridge
+ */
+int nlr_add_bridge(const char *name)
+{
+	char buf[128], *p;
+	struct ifinfomsg ifi;
+	static const char *bridge_type = "bridge";
+
+	memset(buf, 0, sizeof(buf));
+
+	/* NLM_F_EXCL -- if it exists, do nothing. */
+	p = nlmsg_put_hdr(buf, RTM_NEWLINK,
+		NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK);
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+
+	p = add_hdr(p, &ifi, sizeof(ifi));
+
+	p = add_rta(p, IFLA_IFNAME, strlen(name) + 1, (char *)name);
+	struct rtattr *linkinfo = (struct rtattr *)p;
+	p = add_rta(p, IFLA_LINKINFO, 0, NULL);
+	p = add_rta(p, IFLA_INFO_KIND, strlen(bridge_type),
+		(char *)bridge_type);
+	linkinfo->rta_len = p - (char *)linkinfo;
+
+	return do_request(buf, p - buf);
+}
+
+/* ip link del name br0 */
+int nlr_del_iface(int iface_idx)
+{
+	char buf[128], *p;
+	struct ifinfomsg ifi;
+
+	memset(buf, 0, sizeof(buf));
+
+	p = nlmsg_put_hdr(buf, RTM_DELLINK, NLM_F_ACK);
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = iface_idx;
+
+	p = add_hdr(p, &ifi, sizeof(ifi));
+
+	p = add_rta(p, IFLA_MASTER, 4, &iface_idx);
+
+	return do_request(buf, p - buf);
+}
+
+
+/*
+ * Link batch: one RTM_NEWLINK per spec with everything in it -- kind
+ * options, MTU, master and IFF_UP, so a link is ready after one message.
+ */
+#define LINK_MSG_SIZE 512
+#define LINK_KIND_MAX 16 /* Kinds are short: "vxlan", "macvlan", ... */
+
+static int link_msg(char *buf, int msg_type, int flags, const void *obj)
+{
+	const struct nlr_link_spec *spec = obj;
+	char *p;
+	struct ifinfomsg ifi;
+	struct rtattr *linkinfo, *data, *peer;
+	uint16_t vlan = spec->vlan_id;
+	uint16_t port = htons(spec->vxlan.port);
+	uint8_t learning = spec->vxlan.learning > 0;
+	uint32_t u32;
+
+	memset(buf, 0, LINK_MSG_SIZE);
+
+	p = nlmsg_put_hdr(buf, msg_type, flags | NLM_F_ACK);
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = spec->idx > 0 ? spec->idx : 0;
+	if (msg_type == RTM_NEWLINK && spec->up) {
+		ifi.ifi_flags = IFF_UP;
+		ifi.ifi_change = IFF_UP;
+	}
+
+	p = add_hdr(p, &ifi, sizeof(ifi));
+
+	p = add_rta(p, IFLA_IFNAME, strlen(spec->name) + 1, (char *)spec->name);
+
+	if (msg_type != RTM_NEWLINK)
+		return p - buf;
+
+	if (spec->master_idx > 0)
+		p = add_rta(p, IFLA_MASTER, 4, (void *)&spec->master_idx);
+	if (spec->mtu > 0)
+		p = add_rta(p, IFLA_MTU, 4, (void *)&spec->mtu);
+	if (spec->link_idx > 0 && strcmp(spec->kind, "vxlan"))
+		p = add_rta(p, IFLA_LINK, 4, (void *)&spec->link_idx);
+
+	linkinfo = (struct rtattr *)p;
+	p = add_rta(p, IFLA_LINKINFO, 0, NULL);
+	p = add_rta(p, IFLA_INFO_KIND, strlen(spec->kind), (char *)spec->kind);
+	data = (struct rtattr *)p;
+	p = add_rta(p, IFLA_INFO_DATA, 0, NULL);
+
+	if (!strcmp(spec->kind, "vlan")) {
+		p = add_rta(p, IFLA_VLAN_ID, 2, &vlan);
+	} else if (!strcmp(spec->kind, "macvlan")) {
+		if (spec->macvlan_mode > 0)
+			p = add_rta(p, IFLA_MACVLAN_MODE, 4,
+				    (void *)&spec->macvlan_mode);
+	} else if (!strcmp(spec->kind, "vxlan")) {
+		u32 = spec->vxlan.vni;
+		p = add_rta(p, IFLA_VXLAN_ID, 4, &u32);
+		if (spec->vxlan.local)
+			p = add_rta(p, IFLA_VXLAN_LOCAL, 4,
+				    (void *)&spec->vxlan.local);
+		if (spec->vxlan.group)
+			p = add_rta(p, IFLA_VXLAN_GROUP, 4,
+				    (void *)&spec->vxlan.group);
+		if (spec->link_idx > 0)
+			p = add_rta(p, IFLA_VXLAN_LINK, 4,
+				    (void *)&spec->link_idx);
+		if (spec->vxlan.port > 0)
+			p = add_rta(p, IFLA_VXLAN_PORT, 2, &port);
+		if (spec->vxlan.learning)
+			p = add_rta(p, IFLA_VXLAN_LEARNING, 1, &learning);
+	} else if (!strcmp(spec->kind, "veth") && spec->peer) {
+		peer = (struct rtattr *)p;
+		p = add_rta(p, VETH_INFO_PEER, 0, NULL);
+		memset(&ifi, 0, sizeof(ifi));
+		p = add_hdr(p, &ifi, sizeof(ifi));
+		p = add_rta(p, IFLA_IFNAME, strlen(spec->peer) + 1,
+			    (char *)spec->peer);
+		peer->rta_len = p - (char *)peer;
+	}
+
+	/* No options -- no IFLA_INFO_DATA */
+	if (p == (char *)data + RTA_SPACE(0))
+		p = (char *)data;
+	else
+		data->rta_len = p - (char *)data;
+	linkinfo->rta_len = p - (char *)linkinfo;
+
+	return p - buf;
+}
+
+static int links_do(int msg_type, int flags, const struct nlr_link_spec *v,
+		    int n, int *errs)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!v[i].name || strlen(v[i].name) >= IFNAMSIZ
+		    || v[i].peer && strlen(v[i].peer) >= IFNAMSIZ
+		    || msg_type == RTM_NEWLINK && (!v[i].kind
+			|| strlen(v[i].kind) >= LINK_KIND_MAX)) {
+			ERROR("invalid spec of link %d", i);
+			objs_cancel(errs, 0, n);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	return objs_do(link_msg, msg_type, flags, v, sizeof(*v), n, errs);
+}
+
+int nlr_add_links(const struct nlr_link_spec *v, int n, int *errs)
+{
+	return links_do(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, v, n, errs);
+}
+
+int nlr_del_links(const struct nlr_link_spec *v, int n, int *errs)
+{
+	return links_do(RTM_DELLINK, 0, v, n, errs);
+}
+
+/*
+ * Monitor
+ *
+ * With NLR_MON_SYNC the monitor keeps every object of the joined groups
+ * in a hash: key (what identifies the object for the kernel) and
+ * fingerprint (hash of the decoded object). When the socket is overrun,
+ * all the classes are dumped again and compared with the hash: objects
+ * that are new or have another fingerprint are reported as new, objects
+ * that were not dumped -- as deleted.
+ */
+union mon_data {
+	struct nlr_iface iface;
+	struct nlr_addr addr;
+	struct nlr_route route;
+	struct nlr_neigh neigh;
+};
+
+struct mon_key {
+	int cls; /* NLR_MON_* */
+	int a, b, c, d;
+};
+
+struct mon_obj {
+	struct mon_key key;
+	unsigned fp;
+	unsigned gen; /* Resync generation when the object was seen */
+	union mon_data data; /* To report deletion */
+	char name[IFNAMSIZ]; /* data.iface.name */
+	struct mon_obj *next;
+};
+
+struct nlr_monitor {
+	struct nl_sock sock;
+	struct nlr_monitor_ops ops;
+	void *priv;
+	unsigned groups;
+	struct nhs_buf nhs; /* Nexthops of the current route */
+	/* NLR_MON_SYNC */
+	struct mon_obj **objs;
+	unsigned size, n; /* Number of buckets (power of 2) and objects */
+	unsigned gen;
+	int emit; /* 0 -- the initial dump, don't call callbacks */
+};
+
+static void neigh_parse(struct nlmsghdr *nlhdr, struct nlr_neigh *neigh)
+{
+	struct ndmsg *ndm = NLMSG_DATA(nlhdr);
+	struct rtattr *rta;
+	int n;
+
+	memset(neigh, 0, sizeof(*neigh));
+
+	neigh->iface_idx = ndm->ndm_ifindex;
+	neigh->state = ndm->ndm_state;
+	neigh->flags = ndm->ndm_flags;
+
+	for (rta = NDA_RTA(ndm), n = NDA_PAYLOAD(nlhdr);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		if (rta->rta_type == NDA_DST) {
+			neigh->addr = *(in_addr_t *)RTA_DATA(rta);
+		} else if (rta->rta_type == NDA_LLADDR) {
+			if (RTA_PAYLOAD(rta) == 6)
+				memcpy(neigh->lladdr, RTA_DATA(rta), 6);
+		}
+	}
+}
+
+static int neigh_req(struct nl_sock *sock, char *buf, int iface_idx)
+{
+	char *p;
+	struct ndmsg ndm;
+	uint32_t idx = iface_idx;
+
+	memset(buf, 0, 64);
+
+	p = nlmsg_put_hdr(buf, RTM_GETNEIGH, NLM_F_DUMP);
+
+	memset(&ndm, 0, sizeof(ndm));
+	ndm.ndm_family = AF_INET;
+
+	p = add_hdr(p, &ndm, sizeof(ndm));
+
+	/* With strict checking the header must be zero, filter is an attr */
+	if (sock->strict_chk && iface_idx > 0)
+		p = add_rta(p, NDA_IFINDEX, 4, &idx);
+
+	return p - buf;
+}
+
+struct neigh_cb_priv {
+	int iface_idx;
+	/* Visitor */
+	int (*cb)(struct nlr_neigh *, void *);
+	void *priv;
+	int stopped;
+	/* List */
+	struct nlr_neigh *neigh;
+	struct nl_arena *arena;
+	int err;
+};
+
+static int neigh_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct neigh_cb_priv *priv = (struct neigh_cb_priv *)_priv;
+	struct ndmsg *ndm;
+	struct nlr_neigh tmp, *neigh;
+
+	if (!nlhdr || priv->err)
+		return 0;
+
+	ndm = NLMSG_DATA(nlhdr);
+
+	if (ndm->ndm_family != AF_INET)
+		return 0;
+
+	if (priv->iface_idx > 0 && priv->iface_idx != ndm->ndm_ifindex)
+		return 0;
+
+	neigh_parse(nlhdr, &tmp);
+
+	if (priv->cb) {
+		if (priv->cb(&tmp, priv->priv)) {
+			priv->stopped = 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	neigh = obj_alloc(priv->arena, sizeof(*neigh));
+	if (!neigh) {
+		ERRNO("failed to alloc nlr_neigh");
+		priv->err = 1;
+		return 0;
+	}
+
+	*neigh = tmp;
+	neigh->pnext = priv->neigh;
+	priv->neigh = neigh;
+
+	return 0;
+}
+
+static int neigh_dump(struct neigh_cb_priv *priv)
+{
+	char buf[64];
+	int len;
+
+	len = neigh_req(&nlsock, buf, priv->iface_idx);
+
+	if (nl_send_msg(&nlsock, buf, len))
+		return -1;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWNEIGH, neigh_cb, priv)) {
+		/* Filtered by nonexistent iface: no neighbours */
+		if (priv->stopped || errno == ENODEV)
+			return 0;
+		return -1;
+	}
+
+	return priv->err ? -1 : 0;
+}
+
+int nlr_foreach_neigh(int iface_idx,
+		      int (*cb)(struct nlr_neigh *, void *), void *priv)
+{
+	struct neigh_cb_priv npriv;
+
+	memset(&npriv, 0, sizeof(npriv));
+	npriv.iface_idx = iface_idx;
+	npriv.cb = cb;
+	npriv.priv = priv;
+
+	return neigh_dump(&npriv);
+}
+
+void nlr_neigh_free(struct nlr_neigh *neigh)
+{
+	struct nlr_neigh *p;
+
+	while (neigh) {
+		p = neigh->pnext;
+		free(neigh);
+		neigh = p;
+	}
+}
+
+struct nlr_neigh *nlr_get_neighs(int iface_idx, int *err)
+{
+	struct neigh_cb_priv npriv;
+
+	if (err)
+		*err = -1;
+
+	memset(&npriv, 0, sizeof(npriv));
+	npriv.iface_idx = iface_idx;
+	npriv.arena = arena;
+
+	if (neigh_dump(&npriv)) {
+		if (!npriv.arena)
+			nlr_neigh_free(npriv.neigh);
+		return NULL;
+	}
+
+	if (err)
+		*err = 0;
+
+	return npriv.neigh;
+}
+
+static int neigh_msg(char *buf, int msg_type, int flags, const void *obj)
+{
+	const struct nlr_neigh *neigh = obj;
+	char *p;
+	struct ndmsg ndm;
+
+	memset(buf, 0, 128);
+
+	p = nlmsg_put_hdr(buf, msg_type, flags | NLM_F_ACK);
+
+	memset(&ndm, 0, sizeof(ndm));
+	ndm.ndm_family = AF_INET;
+	ndm.ndm_ifindex = neigh->iface_idx;
+	ndm.ndm_state = neigh->state > 0 ? neigh->state : NUD_PERMANENT;
+	ndm.ndm_flags = neigh->flags > 0 ? neigh->flags : 0;
+	ndm.ndm_type = RTN_UNICAST;
+
+	p = add_hdr(p, &ndm, sizeof(ndm));
+
+	p = add_rta(p, NDA_DST, 4, (void *)&neigh->addr);
+	if (msg_type == RTM_NEWNEIGH)
+		p = add_rta(p, NDA_LLADDR, 6, (void *)neigh->lladdr);
+
+	return p - buf;
+}
+
+int nlr_add_neighs(const struct nlr_neigh *v, int n, int *errs)
+{
+	return objs_do(neigh_msg, RTM_NEWNEIGH, NLM_F_CREATE | NLM_F_EXCL,
+		       v, sizeof(*v), n, errs);
+}
+
+int nlr_replace_neighs(const struct nlr_neigh *v, int n, int *errs)
+{
+	return objs_do(neigh_msg, RTM_NEWNEIGH, NLM_F_CREATE | NLM_F_REPLACE,
+		       v, sizeof(*v), n, errs);
+}
+
+int nlr_del_neighs(const struct nlr_neigh *v, int n, int *errs)
+{
+	return objs_do(neigh_msg, RTM_DELNEIGH, 0, v, sizeof(*v), n, errs);
+}
+
+/*
+ * Bridge FDB: AF_BRIDGE neighbours. Entries of a bridge port are in the
+ * bridge's database (NTF_MASTER), entries of a VXLAN iface -- in its own
+ * one (NTF_SELF), with the remote VTEP in @dst.
+ */
+static void fdb_parse(struct nlmsghdr *nlhdr, struct nlr_fdb *fdb)
+{
+	struct ndmsg *ndm = NLMSG_DATA(nlhdr);
+	struct rtattr *rta;
+	int n;
+
+	memset(fdb, 0, sizeof(*fdb));
+
+	fdb->iface_idx = ndm->ndm_ifindex;
+	fdb->state = ndm->ndm_state;
+	fdb->flags = ndm->ndm_flags;
+
+	for (rta = NDA_RTA(ndm), n = NDA_PAYLOAD(nlhdr);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		switch (rta->rta_type) {
+		case NDA_LLADDR:
+			if (RTA_PAYLOAD(rta) == 6)
+				memcpy(fdb->mac, RTA_DATA(rta), 6);
+			break;
+		case NDA_MASTER:
+			fdb->master_idx = *(uint32_t *)RTA_DATA(rta);
+			break;
+		case NDA_VLAN:
+			fdb->vlan = *(uint16_t *)RTA_DATA(rta);
+			break;
+		case NDA_DST:
+			if (RTA_PAYLOAD(rta) == 4)
+				fdb->dst = *(in_addr_t *)RTA_DATA(rta);
+			break;
+		case NDA_VNI:
+			fdb->vni = *(uint32_t *)RTA_DATA(rta);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+struct fdb_foreach_priv {
+	int master_idx, port_idx;
+	int (*cb)(struct nlr_fdb *, void *);
+	void *priv;
+	int stopped;
+};
+
+static int fdb_foreach_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct fdb_foreach_priv *priv = (struct fdb_foreach_priv *)_priv;
+	struct nlr_fdb fdb;
+
+	if (!nlhdr)
+		return 0;
+
+	if (((struct ndmsg *)NLMSG_DATA(nlhdr))->ndm_family != AF_BRIDGE)
+		return 0;
+
+	fdb_parse(nlhdr, &fdb);
+
+	if (priv->port_idx > 0 && fdb.iface_idx != priv->port_idx
+	    || priv->master_idx > 0 && fdb.master_idx != priv->master_idx)
+		return 0;
+
+	if (priv->cb(&fdb, priv->priv)) {
+		priv->stopped = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nlr_foreach_fdb(int master_idx, int port_idx,
+		    int (*cb)(struct nlr_fdb *, void *), void *priv)
+{
+	char buf[64], *p;
+	struct ndmsg ndm;
+	uint32_t idx = master_idx;
+	struct fdb_foreach_priv fpriv;
+
+	memset(buf, 0, sizeof(buf));
+
+	p = nlmsg_put_hdr(buf, RTM_GETNEIGH, NLM_F_DUMP);
+
+	memset(&ndm, 0, sizeof(ndm));
+	ndm.ndm_family = AF_BRIDGE;
+
+	/*
+	 * Old kernels take a bare ndmsg as "no filter", so filters are sent
+	 * only with strict checking.
+	 */
+	if (nlsock.strict_chk && port_idx > 0)
+		ndm.ndm_ifindex = port_idx;
+
+	p = add_hdr(p, &ndm, sizeof(ndm));
+
+	if (nlsock.strict_chk && master_idx > 0)
+		p = add_rta(p, NDA_MASTER, 4, &idx);
+
 	if (nl_send_msg(&nlsock, buf, p - buf))
 		return -1;
 
-	return nl_wait_ack(&nlsock);
+	fpriv.master_idx = master_idx;
+	fpriv.port_idx = port_idx;
+	fpriv.cb = cb;
+	fpriv.priv = priv;
+	fpriv.stopped = 0;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWNEIGH, fdb_foreach_cb, &fpriv)) {
+		if (fpriv.stopped || errno == ENODEV)
+			return 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fdb_msg(char *buf, int msg_type, int flags, const void *obj)
+{
+	const struct nlr_fdb *fdb = obj;
+	char *p;
+	struct ndmsg ndm;
+	uint16_t vlan = fdb->vlan;
+	uint32_t vni = fdb->vni;
+
+	memset(buf, 0, 128);
+
+	p = nlmsg_put_hdr(buf, msg_type, flags | NLM_F_ACK);
+
+	memset(&ndm, 0, sizeof(ndm));
+	ndm.ndm_family = AF_BRIDGE;
+	ndm.ndm_ifindex = fdb->iface_idx;
+	ndm.ndm_state = fdb->state > 0 ? fdb->state : NUD_PERMANENT;
+	ndm.ndm_flags = fdb->flags > 0 ? fdb->flags : NTF_SELF;
+
+	p = add_hdr(p, &ndm, sizeof(ndm));
+
+	p = add_rta(p, NDA_LLADDR, 6, (void *)fdb->mac);
+	if (fdb->dst && fdb->dst != INADDR_NONE)
+		p = add_rta(p, NDA_DST, 4, (void *)&fdb->dst);
+	if (fdb->vlan > 0)
+		p = add_rta(p, NDA_VLAN, 2, &vlan);
+	if (fdb->vni > 0)
+		p = add_rta(p, NDA_VNI, 4, &vni);
+
+	return p - buf;
+}
+
+int nlr_add_fdb(const struct nlr_fdb *v, int n, int *errs)
+{
+	return objs_do(fdb_msg, RTM_NEWNEIGH, NLM_F_CREATE | NLM_F_EXCL,
+		       v, sizeof(*v), n, errs);
+}
+
+int nlr_replace_fdb(const struct nlr_fdb *v, int n, int *errs)
+{
+	return objs_do(fdb_msg, RTM_NEWNEIGH, NLM_F_CREATE | NLM_F_REPLACE,
+		       v, sizeof(*v), n, errs);
+}
+
+int nlr_append_fdb(const struct nlr_fdb *v, int n, int *errs)
+{
+	return objs_do(fdb_msg, RTM_NEWNEIGH, NLM_F_CREATE | NLM_F_APPEND,
+		       v, sizeof(*v), n, errs);
+}
+
+int nlr_del_fdb(const struct nlr_fdb *v, int n, int *errs)
+{
+	return objs_do(fdb_msg, RTM_DELNEIGH, 0, v, sizeof(*v), n, errs);
 }
 
 /*
- * ip link add name br0 type bridge
+ * Bridge VLANs: RTM_SETLINK/RTM_DELLINK of AF_BRIDGE with a list of
+ * IFLA_BRIDGE_VLAN_INFO in IFLA_AF_SPEC. A range is a pair of entries
+ * with RANGE_BEGIN and RANGE_END flags, so a trunk with all the VLANs is
+ * one message.
  */
-int nlr_add_bridge(const char *name)
+#define BRVLAN_CHUNK 256 /* Ranges per message */
+
+static int brvlan_msg(char *buf, int msg_type, int iface_idx, int self,
+		      const struct nlr_bridge_vlan *v, int n)
 {
-	char buf[128], *p;
+	char *p;
 	struct ifinfomsg ifi;
-	static const char *bridge_type = "bridge";
+	struct rtattr *afspec;
+	struct bridge_vlan_info vinfo;
+	uint16_t brflags = BRIDGE_FLAGS_SELF;
+	int i;
 
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, NLMSG_SPACE(sizeof(ifi)) + RTA_SPACE(0)
+	       + RTA_SPACE(2));
 
-	/* NLM_F_EXCL -- if it exists, do nothing. */
-	p = nlmsg_put_hdr(buf, RTM_NEWLINK,
-		NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK);
+	p = nlmsg_put_hdr(buf, msg_type, NLM_F_ACK);
 
 	memset(&ifi, 0, sizeof(ifi));
-	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_family = AF_BRIDGE;
+	ifi.ifi_index = iface_idx;
 
 	p = add_hdr(p, &ifi, sizeof(ifi));
 
-	p = add_rta(p, IFLA_IFNAME, strlen(name) + 1, (char *)name);
-	struct rtattr *linkinfo = (struct rtattr *)p;
-	p = add_rta(p, IFLA_LINKINFO, 0, NULL);
-	p = add_rta(p, IFLA_INFO_KIND, strlen(bridge_type),
-		(char *)bridge_type);
-	linkinfo->rta_len = p - (char *)linkinfo;
+	afspec = (struct rtattr *)p;
+	p = add_rta(p, IFLA_AF_SPEC, 0, NULL);
+	if (self)
+		p = add_rta(p, IFLA_BRIDGE_FLAGS, 2, &brflags);
+
+	for (i = 0; i < n; i++) {
+		if (v[i].vid < 1 || v[i].vid > 4094
+		    || v[i].vid_end && (v[i].vid_end < v[i].vid
+					|| v[i].vid_end > 4094)) {
+			ERROR("invalid VLAN range %d-%d", v[i].vid,
+			      v[i].vid_end);
+			errno = EINVAL;
+			return -1;
+		}
 
-	if (nl_send_msg(&nlsock, buf, p - buf))
-		return -1;
+		vinfo.flags = v[i].flags & (BRIDGE_VLAN_INFO_PVID
+					    | BRIDGE_VLAN_INFO_UNTAGGED);
+		if (v[i].vid_end <= v[i].vid) {
+			vinfo.vid = v[i].vid;
+			p = add_rta(p, IFLA_BRIDGE_VLAN_INFO, sizeof(vinfo),
+				    &vinfo);
+			continue;
+		}
 
-	return nl_wait_ack(&nlsock);
+		/* The kernel takes PVID only for a single VLAN */
+		if (vinfo.flags & BRIDGE_VLAN_INFO_PVID) {
+			ERROR("PVID for VLAN range %d-%d", v[i].vid,
+			      v[i].vid_end);
+			errno = EINVAL;
+			return -1;
+		}
+
+		vinfo.flags |= BRIDGE_VLAN_INFO_RANGE_BEGIN;
+		vinfo.vid = v[i].vid;
+		p = add_rta(p, IFLA_BRIDGE_VLAN_INFO, sizeof(vinfo), &vinfo);
+		vinfo.flags ^= BRIDGE_VLAN_INFO_RANGE_BEGIN
+			       | BRIDGE_VLAN_INFO_RANGE_END;
+		vinfo.vid = v[i].vid_end;
+		p = add_rta(p, IFLA_BRIDGE_VLAN_INFO, sizeof(vinfo), &vinfo);
+	}
+
+	afspec->rta_len = p - (char *)afspec;
 
+	return p - buf;
 }
 
-/* ip link del name br0 */
-int nlr_del_iface(int iface_idx)
+static int brvlan_do(int msg_type, int iface_idx, int self,
+		     const struct nlr_bridge_vlan *v, int n)
 {
-	char buf[128], *p;
+	char buf[64 + BRVLAN_CHUNK * 2 * RTA_SPACE(4)];
+	int i, cnt, len;
+
+	for (i = 0; i < n; i += cnt) {
+		cnt = n - i < BRVLAN_CHUNK ? n - i : BRVLAN_CHUNK;
+
+		len = brvlan_msg(buf, msg_type, iface_idx, self, v + i, cnt);
+		if (len < 0 || do_request(buf, len))
+			return -1;
+	}
+
+	return 0;
+}
+
+int nlr_add_bridge_vlans(int iface_idx, int self,
+			 const struct nlr_bridge_vlan *v, int n)
+{
+	return brvlan_do(RTM_SETLINK, iface_idx, self, v, n);
+}
+
+int nlr_del_bridge_vlans(int iface_idx, int self,
+			 const struct nlr_bridge_vlan *v, int n)
+{
+	return brvlan_do(RTM_DELLINK, iface_idx, self, v, n);
+}
+
+struct brvlan_foreach_priv {
+	int iface_idx;
+	int (*cb)(struct nlr_bridge_vlan *, void *);
+	void *priv;
+	int stopped;
+};
+
+static int brvlan_foreach_cb(struct nlmsghdr *nlhdr, void *_priv)
+{
+	struct brvlan_foreach_priv *priv = (struct brvlan_foreach_priv *)_priv;
+	struct ifinfomsg *ifi;
+	struct rtattr *rta, *rta2;
+	struct bridge_vlan_info *vinfo;
+	struct nlr_bridge_vlan vlan;
+	int n, m;
+
+	if (!nlhdr)
+		return 0;
+
+	ifi = NLMSG_DATA(nlhdr);
+	if (ifi->ifi_family != AF_BRIDGE || priv->iface_idx > 0
+	    && ifi->ifi_index != priv->iface_idx)
+		return 0;
+
+	memset(&vlan, 0, sizeof(vlan));
+	vlan.iface_idx = ifi->ifi_index;
+
+	for (rta = IFLA_RTA(ifi), n = RTM_PAYLOAD(nlhdr);
+	     RTA_OK(rta, n); rta = RTA_NEXT(rta, n)) {
+		if (rta->rta_type != IFLA_AF_SPEC)
+			continue;
+
+		for (rta2 = RTA_DATA(rta), m = RTA_PAYLOAD(rta);
+		     RTA_OK(rta2, m); rta2 = RTA_NEXT(rta2, m)) {
+			if (rta2->rta_type != IFLA_BRIDGE_VLAN_INFO
+			    || RTA_PAYLOAD(rta2) < sizeof(*vinfo))
+				continue;
+
+			vinfo = RTA_DATA(rta2);
+			if (vinfo->flags & BRIDGE_VLAN_INFO_RANGE_BEGIN) {
+				vlan.vid = vinfo->vid;
+				continue;
+			}
+			if (!(vinfo->flags & BRIDGE_VLAN_INFO_RANGE_END))
+				vlan.vid = vinfo->vid;
+			vlan.vid_end = vinfo->vid;
+			vlan.flags = vinfo->flags & (BRIDGE_VLAN_INFO_PVID
+						     | BRIDGE_VLAN_INFO_UNTAGGED);
+
+			if (priv->cb(&vlan, priv->priv)) {
+				priv->stopped = 1;
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int nlr_foreach_bridge_vlan(int iface_idx,
+			    int (*cb)(struct nlr_bridge_vlan *, void *),
+			    void *priv)
+{
+	char buf[64], *p;
 	struct ifinfomsg ifi;
+	uint32_t mask = RTEXT_FILTER_BRVLAN_COMPRESSED;
+	struct brvlan_foreach_priv fpriv;
 
 	memset(buf, 0, sizeof(buf));
 
-	p = nlmsg_put_hdr(buf, RTM_DELLINK, NLM_F_ACK);
+	/* Bridge link dumps can't be filtered by the kernel */
+	p = nlmsg_put_hdr(buf, RTM_GETLINK, NLM_F_DUMP);
 
 	memset(&ifi, 0, sizeof(ifi));
-	ifi.ifi_family = AF_UNSPEC;
-	ifi.ifi_index = iface_idx;
+	ifi.ifi_family = AF_BRIDGE;
 
 	p = add_hdr(p, &ifi, sizeof(ifi));
-
-	p = add_rta(p, IFLA_MASTER, 4, &iface_idx);
+	p = add_rta(p, IFLA_EXT_MASK, 4, &mask);
 
 	if (nl_send_msg(&nlsock, buf, p - buf))
 		return -1;
 
-	return nl_wait_ack(&nlsock);
+	fpriv.iface_idx = iface_idx;
+	fpriv.cb = cb;
+	fpriv.priv = priv;
+	fpriv.stopped = 0;
+
+	if (nl_recv_msg(&nlsock, RTM_NEWLINK, brvlan_foreach_cb, &fpriv)) {
+		if (fpriv.stopped)
+			return 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode a notification or a dump reply. Return NLR_MON_* class of the
+ * object or 0 if the message isn't interesting for us.
+ */
+static int mon_decode(struct nlr_monitor *mon, struct nlmsghdr *nlhdr,
+		      union mon_data *d, int *deleted)
+{
+	int type = nlhdr->nlmsg_type;
+	struct rtattr *mp;
+
+	memset(d, 0, sizeof(*d));
+
+	switch (type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		/* See link_cache_cb() */
+		if (((struct ifinfomsg *)NLMSG_DATA(nlhdr))->ifi_family
+		    == AF_BRIDGE)
+			return 0;
+		iface_parse(nlhdr, &d->iface);
+		if (!d->iface.name)
+			d->iface.name = "";
+		*deleted = type == RTM_DELLINK;
+		return NLR_MON_LINK;
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		if (((struct ifaddrmsg *)NLMSG_DATA(nlhdr))->ifa_family
+		    != AF_INET || addr_parse(nlhdr, &d->addr))
+			return 0;
+		*deleted = type == RTM_DELADDR;
+		return NLR_MON_ADDR;
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+		if (((struct rtmsg *)NLMSG_DATA(nlhdr))->rtm_family != AF_INET)
+			return 0;
+		mp = route_parse(nlhdr, &d->route);
+		if (mp) {
+			d->route.nhs = nhs_buf_get(&mon->nhs, d->route.n_nhs);
+			if (!d->route.nhs)
+				return 0;
+			route_parse_nhs(mp, d->route.nhs);
+		}
+		*deleted = type == RTM_DELROUTE;
+		return NLR_MON_ROUTE;
+	case RTM_NEWNEIGH:
+	case RTM_DELNEIGH:
+		if (((struct ndmsg *)NLMSG_DATA(nlhdr))->ndm_family != AF_INET)
+			return 0;
+		neigh_parse(nlhdr, &d->neigh);
+		*deleted = type == RTM_DELNEIGH;
+		return NLR_MON_NEIGH;
+	default:
+		return 0;
+	}
+}
+
+static void mon_emit(struct nlr_monitor *mon, int cls, int deleted,
+		     union mon_data *d)
+{
+	if (cls == NLR_MON_LINK && mon->ops.link)
+		mon->ops.link(deleted, &d->iface, mon->priv);
+	else if (cls == NLR_MON_ADDR && mon->ops.addr)
+		mon->ops.addr(deleted, &d->addr, mon->priv);
+	else if (cls == NLR_MON_ROUTE && mon->ops.route)
+		mon->ops.route(deleted, &d->route, mon->priv);
+	else if (cls == NLR_MON_NEIGH && mon->ops.neigh)
+		mon->ops.neigh(deleted, &d->neigh, mon->priv);
+}
+
+static unsigned mon_hash(const void *data, int len, unsigned h)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u; /* FNV-1a */
+	return h;
+}
+
+/* Get key and fingerprint of the object. */
+static unsigned mon_key(int cls, union mon_data *d, struct mon_key *key)
+{
+	union mon_data tmp;
+	unsigned h = 2166136261u;
+
+	memset(key, 0, sizeof(*key));
+	key->cls = cls;
+
+	tmp = *d;
+	switch (cls) {
+	case NLR_MON_LINK:
+		key->a = d->iface.idx;
+		/* Counters change all the time, it's not a change for us */
+		memset(&tmp.iface.stats, 0, sizeof(tmp.iface.stats));
+		tmp.iface.name = NULL;
+		h = mon_hash(d->iface.name, strlen(d->iface.name), h);
+		break;
+	case NLR_MON_ADDR:
+		key->a = d->addr.iface_idx;
+		key->b = d->addr.addr;
+		key->c = d->addr.prefix_len;
+		break;
+	case NLR_MON_ROUTE:
+		key->a = d->route.table;
+		key->b = d->route.dest;
+		key->c = d->route.dest_plen;
+		key->d = d->route.metrics;
+		tmp.route.nhs = NULL;
+		h = mon_hash(d->route.nhs, d->route.n_nhs * sizeof(struct nlr_nh),
+			     h);
+		break;
+	case NLR_MON_NEIGH:
+		key->a = d->neigh.iface_idx;
+		key->b = d->neigh.addr;
+		break;
+	}
+
+	return mon_hash(&tmp, sizeof(tmp), h);
+}
+
+static struct mon_obj **mon_find(struct nlr_monitor *mon,
+				 struct mon_key *key)
+{
+	struct mon_obj **pp;
+
+	pp = &mon->objs[mon_hash(key, sizeof(*key), 2166136261u)
+			& (mon->size - 1)];
+	while (*pp && memcmp(&(*pp)->key, key, sizeof(*key)))
+		pp = &(*pp)->next;
+	return pp;
+}
+
+static int mon_grow(struct nlr_monitor *mon)
+{
+	struct mon_obj **objs, *o, *next;
+	unsigned size = mon->size ? mon->size * 2 : 256, i, h;
+
+	objs = calloc(size, sizeof(*objs));
+	if (!objs) {
+		ERRNO("failed to alloc monitor hash");
+		return -1;
+	}
+
+	for (i = 0; i < mon->size; i++) {
+		for (o = mon->objs[i]; o; o = next) {
+			next = o->next;
+			h = mon_hash(&o->key, sizeof(o->key), 2166136261u)
+				& (size - 1);
+			o->next = objs[h];
+			objs[h] = o;
+		}
+	}
+
+	free(mon->objs);
+	mon->objs = objs;
+	mon->size = size;
+
+	return 0;
+}
+
+/*
+ * Update the hash with the object. Return 1 if it's a change for us
+ * (new object or another fingerprint), 0 if not, -1 on error.
+ */
+static int mon_track(struct nlr_monitor *mon, int cls, int deleted,
+		     union mon_data *d)
+{
+	struct mon_key key;
+	struct mon_obj **pp, *o;
+	unsigned fp;
+
+	if (mon->n >= mon->size && mon_grow(mon))
+		return -1;
+
+	fp = mon_key(cls, d, &key);
+	pp = mon_find(mon, &key);
+	o = *pp;
+
+	if (deleted) {
+		if (!o)
+			return 0;
+		*pp = o->next;
+		free(o);
+		mon->n--;
+		return 1;
+	}
+
+	if (!o) {
+		o = malloc(sizeof(*o));
+		if (!o) {
+			ERRNO("failed to alloc monitor object");
+			return -1;
+		}
+		o->key = key;
+		o->next = NULL;
+		*pp = o;
+		mon->n++;
+	} else if (o->fp == fp) {
+		o->gen = mon->gen;
+		return 0;
+	}
+
+	o->fp = fp;
+	o->gen = mon->gen;
+	o->data = *d;
+	if (cls == NLR_MON_LINK) {
+		strncpy(o->name, d->iface.name, sizeof(o->name) - 1);
+		o->name[sizeof(o->name) - 1] = '\0';
+		o->data.iface.name = o->name;
+	}
+	/* Nexthops aren't kept, the key is enough to report deletion */
+	if (cls == NLR_MON_ROUTE) {
+		o->data.route.n_nhs = 0;
+		o->data.route.nhs = NULL;
+	}
+
+	return 1;
+}
+
+static int monitor_cb(struct nlmsghdr *nlhdr, void *_mon)
+{
+	struct nlr_monitor *mon = (struct nlr_monitor *)_mon;
+	union mon_data d;
+	int cls, deleted;
+
+	cls = mon_decode(mon, nlhdr, &d, &deleted);
+	if (!cls)
+		return 0;
+
+	/* Repeated notification (e.g. after resync) isn't a change */
+	if (mon->objs && !mon_track(mon, cls, deleted, &d))
+		return 0;
+
+	mon_emit(mon, cls, deleted, &d);
+
+	return 0;
+}
+
+static int monitor_drop_cb(struct nlmsghdr *nlhdr, void *priv)
+{
+	return 0;
+}
+
+/* Dump reply: report only changes. */
+static int monitor_sync_cb(struct nlmsghdr *nlhdr, void *_mon)
+{
+	struct nlr_monitor *mon = (struct nlr_monitor *)_mon;
+	union mon_data d;
+	int cls, deleted, r;
+
+	if (!nlhdr)
+		return 0;
+
+	cls = mon_decode(mon, nlhdr, &d, &deleted);
+	if (!cls)
+		return 0;
+
+	r = mon_track(mon, cls, 0, &d);
+	if (r < 0)
+		return -1;
+	if (r && mon->emit)
+		mon_emit(mon, cls, 0, &d);
+
+	return 0;
+}
+
+static int monitor_dump(struct nlr_monitor *mon, int cls)
+{
+	char buf[128];
+	int len, type;
+
+	switch (cls) {
+	case NLR_MON_LINK:
+		len = iface_req(buf, -1, NULL, -1);
+		type = RTM_NEWLINK;
+		break;
+	case NLR_MON_ADDR:
+		len = addr_req(&nlsock, buf, -1);
+		type = RTM_NEWADDR;
+		break;
+	case NLR_MON_ROUTE:
+		len = route_req(&nlsock, buf, NULL);
+		type = RTM_NEWROUTE;
+		break;
+	default:
+		len = neigh_req(&nlsock, buf, -1);
+		type = RTM_NEWNEIGH;
+		break;
+	}
+
+	if (nl_send_msg(&nlsock, buf, len))
+		return -1;
+
+	return nl_recv_msg(&nlsock, type, monitor_sync_cb, mon);
+}
+
+/* Dump all the joined classes, report what was changed. */
+static int monitor_resync(struct nlr_monitor *mon)
+{
+	struct mon_obj **pp, *o;
+	unsigned i;
+	int cls;
+
+	mon->gen++;
+
+	for (cls = NLR_MON_LINK; cls <= NLR_MON_NEIGH; cls <<= 1) {
+		if ((mon->groups & cls) && monitor_dump(mon, cls))
+			return -1;
+	}
+
+	/* Not dumped -- deleted while we didn't listen */
+	for (i = 0; i < mon->size; i++) {
+		for (pp = &mon->objs[i]; (o = *pp); ) {
+			if (o->gen == mon->gen) {
+				pp = &o->next;
+				continue;
+			}
+			*pp = o->next;
+			mon->n--;
+			if (mon->emit)
+				mon_emit(mon, o->key.cls, 1, &o->data);
+			free(o);
+		}
+	}
+
+	return 0;
+}
+
+struct nlr_monitor *nlr_monitor_open(unsigned groups,
+				     const struct nlr_monitor_ops *ops,
+				     void *priv)
+{
+	static const struct {
+		unsigned mask;
+		int group;
+	} map[] = {
+		{ NLR_MON_LINK, RTNLGRP_LINK },
+		{ NLR_MON_ADDR, RTNLGRP_IPV4_IFADDR },
+		{ NLR_MON_ROUTE, RTNLGRP_IPV4_ROUTE },
+		{ NLR_MON_NEIGH, RTNLGRP_NEIGH },
+	};
+	struct nlr_monitor *mon;
+	int i;
+
+	mon = calloc(1, sizeof(*mon));
+	if (!mon) {
+		ERRNO("failed to alloc monitor");
+		return NULL;
+	}
+
+	if (nl_open(&mon->sock, NETLINK_ROUTE)) {
+		free(mon);
+		return NULL;
+	}
+
+	for (i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+		if (!(groups & map[i].mask))
+			continue;
+		if (nl_add_membership(&mon->sock, map[i].group))
+			goto err;
+	}
+
+	if (ops)
+		mon->ops = *ops;
+	mon->priv = priv;
+	mon->groups = groups;
+
+	/* Joined before the dump, so we don't miss any changes */
+	if (groups & NLR_MON_SYNC) {
+		if (mon_grow(mon) || monitor_resync(mon))
+			goto err;
+		mon->emit = 1;
+	}
+
+	return mon;
+
+err:
+	nlr_monitor_close(mon);
+	return NULL;
+}
+
+int nlr_monitor_set_rcvbuf(struct nlr_monitor *mon, int size)
+{
+	return nl_set_rcvbuf(&mon->sock, size);
+}
+
+int nlr_monitor_fd(struct nlr_monitor *mon)
+{
+	return mon->sock.sock;
+}
+
+int nlr_monitor_dispatch(struct nlr_monitor *mon)
+{
+	while (nl_recv_notify(&mon->sock, monitor_cb, mon)) {
+		if (errno != ENOBUFS)
+			return -1;
+		DEBUG("monitor socket was overrun, resync");
+		/* Queued notifications are older than the dump */
+		while (nl_recv_notify(&mon->sock, monitor_drop_cb, NULL)) {
+			if (errno != ENOBUFS)
+				return -1;
+		}
+		/* Without NLR_MON_SYNC the caller reloads */
+		if (!mon->objs) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		if (monitor_resync(mon))
+			return -1;
+	}
+
+	return 0;
 }
 
+void nlr_monitor_close(struct nlr_monitor *mon)
+{
+	struct mon_obj *o, *next;
+	unsigned i;
+
+	if (!mon)
+		return;
+
+	for (i = 0; i < mon->size; i++) {
+		for (o = mon->objs[i]; o; o = next) {
+			next = o->next;
+			free(o);
+		}
+	}
+	free(mon->objs);
+	free(mon->nhs.v);
+
+	nl_close(&mon->sock);
+	free(mon);
+}
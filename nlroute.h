@@ -1,6 +1,7 @@
 #ifndef _NLROUTE_H
 #define _NLROUTE_H
 
+#include <stdint.h>
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <linux/rtnetlink.h>
@@ -8,9 +9,34 @@
 int nlr_init(void);
 void nlr_fin(void);
 
+/*
+ * After this call lists returned by nlr_iface*(), nlr_get_addr(),
+ * nlr_get_routes*() and their asynchronous variants are allocated from
+ * @arena (see nlcore.h), iface names -- inline, right after the struct.
+ * Don't free them with nlr_*_free(): free the whole arena at once.
+ * nlr_set_arena(NULL) switches back to malloc().
+ */
+struct nl_arena;
+void nlr_set_arena(struct nl_arena *arena);
+
+/*
+ * Both are served from the link cache: the first call dumps all ifaces,
+ * then the cache is kept up to date by notifications. A hit takes no
+ * syscalls, pending notifications are read only on a miss, so a renamed
+ * or recreated iface can be seen by its old name until the next sync.
+ * nlr_iface_name() returns dynamically allocated string.
+ */
 int nlr_iface_idx(const char *name);
 char *nlr_iface_name(int idx);
 
+/*
+ * A daemon can add this fd to its poll set and call
+ * nlr_link_cache_sync() when it's readable, or call it once before a
+ * series of lookups (one non-blocking recv()).
+ */
+int nlr_link_cache_fd(void);
+int nlr_link_cache_sync(void);
+
 enum nlr_iface_type {
 	NLR_IFACE_TYPE_ETHERNET = 0,
 	NLR_IFACE_TYPE_LOOPBACK,
@@ -19,6 +45,8 @@ enum nlr_iface_type {
 	NLR_IFACE_TYPE_VLAN,
 	NLR_IFACE_TYPE_TUNNEL,
 	NLR_IFACE_TYPE_BONDING,
+	NLR_IFACE_TYPE_VXLAN,
+	NLR_IFACE_TYPE_MACVLAN,
 };
 
 struct nlr_iface {
@@ -40,8 +68,36 @@ struct nlr_iface {
 	IMPORTANT: in Cisco VLAN iface is a subinterface, not an independent
 	interface.
 	*/
+	/* Decoded IFLA_INFO_DATA, by @type */
 	union {
-		int vlan_id;
+		int vlan_id; /* The same as vlan.id */
+		struct {
+			int id;
+			int proto; /* ETH_P_8021Q, ETH_P_8021AD */
+		} vlan;
+		struct {
+			int mode; /* BOND_MODE_* of linux/if_bonding.h */
+			int miimon; /* ms */
+			int active_slave_idx;
+		} bond;
+		struct {
+			int vni;
+			in_addr_t local;
+			in_addr_t group; /* Remote VTEP or multicast group */
+			int link_idx;
+			int port;
+			int ttl;
+			int learning;
+		} vxlan;
+		struct {
+			int mode; /* MACVLAN_MODE_* */
+		} macvlan;
+		struct {
+			int stp;
+			int vlan_filtering;
+			int ageing_time; /* 1/100 s */
+			int priority;
+		} bridge;
 	} options;
 	struct {
 		long tx_bytes, tx_packets;
@@ -56,6 +112,10 @@ struct nlr_iface {
  * 'error-occured' case by @err value.
  */
 struct nlr_iface *nlr_iface(int iface_idx, int *err);
+/* Get one iface by name (no dump). */
+struct nlr_iface *nlr_iface_by_name(const char *name, int *err);
+/* Get ifaces enslaved to @master_idx (e.g. bridge ports). */
+struct nlr_iface *nlr_iface_by_master(int master_idx, int *err);
 
 void nlr_iface_free(struct nlr_iface *iface);
 
@@ -80,6 +140,17 @@ int nlr_set_iface(int iface_idx, int up);
 
 int nlr_set_mac_addr(int iface_idx, char addr[6]);
 
+/* Path of a multipath (ECMP) route */
+struct nlr_nh {
+	in_addr_t gw; /* 0 -- directly connected */
+	int oif;
+	int weight; /* 1..256, <=0 -- 1 on adding */
+	unsigned flags; /* RTNH_F_* */
+};
+
+/* Max paths of a route being added */
+#define NLR_MAX_NHS 64
+
 struct nlr_route {
 	int table;
 	int type;
@@ -93,26 +164,385 @@ struct nlr_route {
 	in_addr_t gw;
 	int oif; /* Output interface index */
 	in_addr_t prefsrc; /* Preffered source address */
+	int nh_id; /* Nexthop object, 0 -- none (then @gw and @oif are used) */
+	/*
+	 * Multipath route: @n_nhs > 0, @gw and @oif are 0. In lists @nhs is
+	 * stored with the route, in visitors and monitors it's valid only
+	 * during the callback.
+	 */
+	int n_nhs;
+	struct nlr_nh *nhs;
 
 	struct nlr_route *pnext;
 };
 
 int nlr_add_route(in_addr_t dest, int dest_plen, in_addr_t gw);
 int nlr_del_route(in_addr_t dest, int dest_plen, in_addr_t gw);
+/*
+ * Add/delete @n routes with a few sendmsg() calls. Fields of a route
+ * are unset as in a filter (<0, INADDR_NONE, @oif 0), @gw and @prefsrc
+ * also if 0. Unset @table is RT_TABLE_MAIN. On adding unset @type is
+ * RTN_UNICAST, @scope -- RT_SCOPE_UNIVERSE, @proto -- RTPROT_STATIC;
+ * on deleting they match any route. @pnext is ignored.
+ * Result of the i-th route is stored in @errs[i]: 0 or -errno, -ECANCELED
+ * if it wasn't sent (also when -1 is returned); inside a batch queued
+ * routes get 0. @errs can be NULL. Return number of failed routes or -1.
+ */
+int nlr_add_routes(const struct nlr_route *v, int n, int *errs);
+int nlr_del_routes(const struct nlr_route *v, int n, int *errs);
+
+struct nlr_sync_stats {
+	int added, replaced, deleted, unchanged;
+	int failed;
+};
+
+/*
+ * Make routes of @proto in @table to be @desired: dump them, diff and
+ * apply only the changes (new routes are added, changed are replaced,
+ * others are deleted). Routes are matched by dest, prefix length and
+ * metric; @table and @proto of desired routes are ignored. Unset fields
+ * are as in nlr_add_routes(). Return number of failed changes or -1,
+ * fill @stats (can be NULL) in both cases.
+ */
+int nlr_sync_routes(const struct nlr_route *desired, int n, int table,
+		    int proto, struct nlr_sync_stats *stats);
+
+/*
+ * Nexthop object: a gateway/iface, a blackhole or a group of other
+ * nexthops. Routes refer to it by @nh_id, so when a gateway changes,
+ * nlr_replace_nexthop() moves all its routes with one message.
+ */
+struct nlr_nexthop {
+	int id;
+	int proto; /* RTPROT_*, <0 -- RTPROT_STATIC on adding */
+	int blackhole;
+	in_addr_t gw; /* 0 -- none */
+	int oif;
+	int n_group; /* >0 -- it's a group, @gw, @oif are unused */
+	struct nlr_nexthop_grp {
+		int id;
+		int weight; /* 1..256 */
+	} *group;
+	struct nlr_nexthop *pnext;
+};
+
+/* IPv4 nexthops and groups. */
+struct nlr_nexthop *nlr_get_nexthops(int *err);
+void nlr_nexthop_free(struct nlr_nexthop *nh);
+
+int nlr_add_nexthop(struct nlr_nexthop *nh);
+int nlr_replace_nexthop(struct nlr_nexthop *nh);
+/* Routes using the nexthop are deleted by the kernel too. */
+int nlr_del_nexthop(int id);
 /*
  * You can filter what routes you want to get by setting this
  * fields of @filter: @table, @type, @scope, @proto, @dest,
  * @dest_plen, @gw, @oif, @prefsrc. If int field has negative value,
- * it will be treated as unset ("any"). If addr field has INADDR_NONE(-1)
- * value, it will be treated as unset ("any"). @filter can be NULL.
+ * it will be treated as unset ("any"), @oif also if it's 0. If addr
+ * field has INADDR_NONE(-1) value, it will be treated as unset ("any").
+ * @filter can be NULL. Routes are filtered while the dump is received,
+ * rejected ones are never allocated.
  */
 struct nlr_route *nlr_get_routes(struct nlr_route *filter, int *err);
 void nlr_free_routes(struct nlr_route *r);
 
+/*
+ * Compiled predicate: @filter (can be NULL) and also a set of protocols
+ * and a set of prefix ranges. A route matches a range if its dest is
+ * inside @prefix/@plen and @ge <= dest_plen <= @le (0 means @plen for
+ * @ge and 32 for @le, i.e. the prefix and all more specific routes).
+ * Ranges with @ge < @plen, @le > 32 or @ge > @le are rejected.
+ * Empty set means "any".
+ */
+struct nlr_prefix_range {
+	in_addr_t prefix;
+	int plen;
+	int ge, le;
+};
+
+struct nlr_route_pred;
+
+struct nlr_route_pred *nlr_route_pred_compile(struct nlr_route *filter,
+	const int *protos, int n_protos,
+	const struct nlr_prefix_range *ranges, int n_ranges);
+void nlr_route_pred_free(struct nlr_route_pred *pred);
+int nlr_route_pred_match(struct nlr_route_pred *pred, struct nlr_route *r);
+struct nlr_route *nlr_get_routes_pred(struct nlr_route_pred *pred, int *err);
+
+/*
+ * Visitors: instead of building a list, call @cb for every object right
+ * from the receive loop. The object is decoded into a struct on the stack
+ * and is valid only during the call (names point into the netlink
+ * message), nothing is allocated. If @cb returns non-zero, the walk is
+ * stopped. Return 0 or -1 on error. Arguments are the same as of
+ * nlr_iface(), nlr_get_addr() and nlr_get_routes().
+ * @cb may call nlr_iface_name()/nlr_iface_idx(), but not other requests:
+ * the dump is being read from the same socket.
+ */
+int nlr_foreach_iface(int iface_idx,
+		      int (*cb)(struct nlr_iface *, void *), void *priv);
+int nlr_foreach_addr(int iface_idx,
+		     int (*cb)(struct nlr_addr *, void *), void *priv);
+int nlr_foreach_route(struct nlr_route *filter,
+		      int (*cb)(struct nlr_route *, void *), void *priv);
+int nlr_foreach_route_pred(struct nlr_route_pred *pred,
+			   int (*cb)(struct nlr_route *, void *), void *priv);
+
+/* 64-bit iface counters */
+struct nlr_link_stats {
+	int iface_idx;
+	uint64_t rx_packets, tx_packets;
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t rx_errors, tx_errors;
+	uint64_t rx_dropped, tx_dropped;
+	uint64_t multicast, collisions;
+};
+
+/*
+ * Poll counters with RTM_GETSTATS: only the counters are sent by the
+ * kernel, not the whole iface. If @iface_idx <= 0, walk all ifaces,
+ * the visitor rules above apply. Kernel 4.7+.
+ */
+int nlr_foreach_link_stats(int iface_idx,
+			   int (*cb)(struct nlr_link_stats *, void *),
+			   void *priv);
+int nlr_get_link_stats(int iface_idx, struct nlr_link_stats *stats);
+
+/*
+ * Like "ip route get": the kernel resolves the route to @dest.
+ * Returns 0 and fills @route on success (errno=ENETUNREACH if no route).
+ */
+int nlr_route_lookup(in_addr_t dest, struct nlr_route *route);
+
+/*
+ * Route snapshot: routes are stored in dense arrays (struct of arrays)
+ * instead of a list, a route is a row index. @dest is in host byte
+ * order, so it sorts and compares as a number; @gw is in network byte
+ * order, like everywhere.
+ */
+struct nlr_route_snap {
+	int n; /* Number of routes */
+	int size; /* Allocated rows */
+	int sorted; /* Sorted by (dest, plen) */
+	uint32_t *dest;
+	unsigned char *plen;
+	in_addr_t *gw;
+	int *oif;
+	unsigned *table;
+	unsigned char *proto;
+};
+
+void nlr_snap_init(struct nlr_route_snap *s);
+void nlr_snap_free(struct nlr_route_snap *s);
+/* Dump routes matching @pred (NULL -- all) into @s, replacing its rows. */
+int nlr_snap_load(struct nlr_route_snap *s, struct nlr_route_pred *pred);
+int nlr_snap_sort(struct nlr_route_snap *s);
+/* Binary search in the sorted snapshot. Return row or -1. */
+int nlr_snap_find(struct nlr_route_snap *s, in_addr_t dest, int plen);
+/*
+ * Routes inside @prefix/@plen (the prefix itself and more specific ones)
+ * are adjacent rows in the sorted snapshot: return their number and
+ * the first row in @first.
+ */
+int nlr_snap_within(struct nlr_route_snap *s, in_addr_t prefix, int plen,
+		    int *first);
+/*
+ * Scan: store rows with the given @table, @proto and @oif (<0 -- any) in
+ * @rows (must have room for @s->n rows), return their number.
+ */
+int nlr_snap_select(struct nlr_route_snap *s, int table, int proto, int oif,
+		    int *rows);
+
 int nlr_add_bridge(const char *name);
 int nlr_add_vlan(const char *name, int master_idx, int vlan_id);
 int nlr_del_iface(int iface_idx);
 /* To unset master, set @master_idx<0. */
 int nlr_set_master(int iface_idx, int master_idx);
 
+/* A link to create with nlr_add_links() */
+struct nlr_link_spec {
+	const char *name;
+	const char *kind; /* "vlan", "veth", "dummy", "vxlan", "macvlan",
+	"bridge", ... */
+	int idx; /* 0 -- any. Set it to enslave later links of the batch
+	to this one. */
+	int link_idx; /* Lower iface of vlan, macvlan, vxlan; 0 -- none */
+	int master_idx; /* 0 -- none */
+	int mtu; /* 0 -- default */
+	int up;
+	int vlan_id;
+	int macvlan_mode; /* MACVLAN_MODE_*, 0 -- default */
+	const char *peer; /* Name of the veth peer, NULL -- any */
+	struct {
+		int vni;
+		in_addr_t local, group; /* 0 -- none */
+		int port; /* 0 -- default */
+		int learning; /* 0 -- default (on), >0 -- on, <0 -- off */
+	} vxlan;
+};
+
+/*
+ * Create @n links with a few sendmsg() calls (like nlr_add_routes()):
+ * every link is created, enslaved and set up by one message. Links are
+ * created in order, so a link can use a master or a lower link created
+ * earlier in the same call. nlr_del_links() deletes links by @name (and
+ * @idx if it's set). Return number of failed links or -1, result of the
+ * i-th link is in @errs[i] as in nlr_add_routes().
+ */
+int nlr_add_links(const struct nlr_link_spec *v, int n, int *errs);
+int nlr_del_links(const struct nlr_link_spec *v, int n, int *errs);
+
+/*
+ * Asynchronous variants of nlr_iface(), nlr_get_addr() and
+ * nlr_get_routes(): they return at once and @done gets the result list
+ * (the callee frees it) and 0 or -errno. Add nlr_async_fd() to your
+ * poll/epoll set and call nlr_async_dispatch() when it's readable:
+ * @done callbacks are called from there.
+ */
+int nlr_async_fd(void);
+int nlr_async_dispatch(void);
+int nlr_iface_async(int iface_idx,
+		    void (*done)(struct nlr_iface *, int, void *), void *priv);
+int nlr_get_addr_async(int iface_idx,
+		       void (*done)(struct nlr_addr *, int, void *), void *priv);
+int nlr_get_routes_async(struct nlr_route *filter,
+			 void (*done)(struct nlr_route *, int, void *),
+			 void *priv);
+
+/*
+ * Between nlr_batch_begin() and nlr_batch_end() mutating calls
+ * (nlr_add_route(), nlr_add_addr(), nlr_set_iface(), nlr_add_vlan(), ...)
+ * don't talk to the kernel: they only queue requests and return 0.
+ * nlr_batch_end() sends them with a few sendmsg() calls and collects ACKs.
+ * Result of the i-th queued request is stored in @errs[i]: 0 or -errno.
+ * @errs can be NULL. Return number of failed requests or -1.
+ */
+int nlr_batch_begin(void);
+int nlr_batch_end(int *errs);
+
+/* ARP entry */
+struct nlr_neigh {
+	int iface_idx;
+	in_addr_t addr;
+	unsigned char lladdr[6];
+	int state; /* NUD_REACHABLE, NUD_STALE, ... */
+	int flags; /* NTF_* */
+	struct nlr_neigh *pnext;
+};
+
+/* @iface_idx <= 0 -- of all ifaces. */
+struct nlr_neigh *nlr_get_neighs(int iface_idx, int *err);
+void nlr_neigh_free(struct nlr_neigh *neigh);
+/* Visitor, see nlr_foreach_iface(). */
+int nlr_foreach_neigh(int iface_idx,
+		      int (*cb)(struct nlr_neigh *, void *), void *priv);
+
+/*
+ * Program @n entries with a few sendmsg() calls, like nlr_add_routes().
+ * @state <= 0 is NUD_PERMANENT, @pnext is ignored.
+ */
+int nlr_add_neighs(const struct nlr_neigh *v, int n, int *errs);
+int nlr_replace_neighs(const struct nlr_neigh *v, int n, int *errs);
+int nlr_del_neighs(const struct nlr_neigh *v, int n, int *errs);
+
+/* Bridge/VXLAN forwarding database entry */
+struct nlr_fdb {
+	int iface_idx; /* Bridge port or VXLAN iface */
+	int master_idx; /* Bridge, 0 -- none */
+	unsigned char mac[6];
+	int vlan; /* 0 -- none */
+	in_addr_t dst; /* Remote VTEP of VXLAN, 0 -- none */
+	int vni; /* 0 -- VNI of the VXLAN iface */
+	int state; /* NUD_PERMANENT, NUD_NOARP, NUD_REACHABLE */
+	int flags; /* NTF_SELF, NTF_MASTER, NTF_EXT_LEARNED, ... */
+};
+
+/*
+ * Visitor (see nlr_foreach_iface()) of FDB entries of bridge @master_idx
+ * and port @port_idx, <= 0 -- any.
+ */
+int nlr_foreach_fdb(int master_idx, int port_idx,
+		    int (*cb)(struct nlr_fdb *, void *), void *priv);
+
+/*
+ * Program @n entries with a few sendmsg() calls, like nlr_add_routes().
+ * @state <= 0 is NUD_PERMANENT, @flags <= 0 is NTF_SELF (use NTF_MASTER
+ * for entries of a bridge port), @master_idx is ignored.
+ * nlr_append_fdb() adds one more remote VTEP for a MAC (e.g. for BUM
+ * traffic on 00:00:00:00:00:00).
+ */
+int nlr_add_fdb(const struct nlr_fdb *v, int n, int *errs);
+int nlr_replace_fdb(const struct nlr_fdb *v, int n, int *errs);
+int nlr_append_fdb(const struct nlr_fdb *v, int n, int *errs);
+int nlr_del_fdb(const struct nlr_fdb *v, int n, int *errs);
+
+/* VLANs @vid..@vid_end of a bridge port */
+struct nlr_bridge_vlan {
+	int iface_idx;
+	int vid;
+	int vid_end; /* 0 -- only @vid */
+	int flags; /* BRIDGE_VLAN_INFO_PVID, BRIDGE_VLAN_INFO_UNTAGGED */
+};
+
+/*
+ * Add/delete VLAN ranges of bridge port @iface_idx (@iface_idx of the
+ * ranges is ignored), up to 256 ranges per message. With @self VLANs of
+ * the bridge itself are configured. PVID can be set only for a single
+ * VLAN, a range with it fails with EINVAL. Wrap calls for many ports
+ * into nlr_batch_begin()/nlr_batch_end() to send them at once.
+ */
+int nlr_add_bridge_vlans(int iface_idx, int self,
+			 const struct nlr_bridge_vlan *v, int n);
+int nlr_del_bridge_vlans(int iface_idx, int self,
+			 const struct nlr_bridge_vlan *v, int n);
+
+/*
+ * Visitor (see nlr_foreach_iface()) of VLAN ranges of bridge ports (and
+ * bridges), consecutive VLANs with the same flags are one range.
+ * @iface_idx <= 0 -- all ports.
+ */
+int nlr_foreach_bridge_vlan(int iface_idx,
+			    int (*cb)(struct nlr_bridge_vlan *, void *),
+			    void *priv);
+
+/*
+ * Monitor: receive notifications about changes instead of polling.
+ * @groups is a mask of NLR_MON_* groups to join. Callbacks get @deleted
+ * flag (RTM_DEL* message) and a decoded object, which is valid only
+ * during the call (copy what you need). Unset callbacks are skipped.
+ * Add nlr_monitor_fd() to your poll set and call nlr_monitor_dispatch()
+ * when it's readable. If it returns -1 with errno=ENOBUFS, some
+ * notifications were lost (the socket buffer was overrun) and you have
+ * to re-read the state with nlr_iface()/nlr_get_routes()/... (queued
+ * notifications are dropped then, they are older than your dump).
+ *
+ * With NLR_MON_SYNC the monitor does it itself: it remembers all the
+ * objects of the joined groups (nlr_monitor_open() dumps them), and
+ * after an overrun dumps them again and calls callbacks only for the
+ * difference -- new, changed and deleted objects.
+ */
+#define NLR_MON_LINK  0x1
+#define NLR_MON_ADDR  0x2
+#define NLR_MON_ROUTE 0x4
+#define NLR_MON_NEIGH 0x8
+#define NLR_MON_SYNC  0x100
+
+struct nlr_monitor_ops {
+	void (*link)(int deleted, struct nlr_iface *iface, void *priv);
+	void (*addr)(int deleted, struct nlr_addr *addr, void *priv);
+	void (*route)(int deleted, struct nlr_route *route, void *priv);
+	void (*neigh)(int deleted, struct nlr_neigh *neigh, void *priv);
+};
+
+struct nlr_monitor;
+
+struct nlr_monitor *nlr_monitor_open(unsigned groups,
+				     const struct nlr_monitor_ops *ops,
+				     void *priv);
+/* Socket receive buffer size, set it big to make overruns rare. */
+int nlr_monitor_set_rcvbuf(struct nlr_monitor *mon, int size);
+int nlr_monitor_fd(struct nlr_monitor *mon);
+int nlr_monitor_dispatch(struct nlr_monitor *mon);
+void nlr_monitor_close(struct nlr_monitor *mon);
+
 #endif
@@ -0,0 +1,393 @@
+/*
+ * Every iface has a ring of @depth entries: a sample and rates computed
+ * from it and the previous one. The poller is the only writer: it fills
+ * entry head % depth and then publishes head + 1. A reader loads head,
+ * copies entries and loads head again: an entry i was (or is being)
+ * overwritten if the new head >= i + depth, such entries are dropped.
+ * The oldest entry can be being rewritten at any time, so only
+ * depth - 1 entries are readable. As in a seqlock, the poller has a
+ * release fence before it rewrites an entry and readers have an acquire
+ * fence after the copy, so this holds on weakly ordered CPUs too.
+ *
+ * Ifaces are in an open addressing table of fixed size, so entries never
+ * move. A slot of a gone iface is marked and reused for a new one, so
+ * readers check that the slot has the same iface after the copy.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "nlcore.h"
+#include "nlroute.h"
+#include "nlsampler.h"
+
+#define SMP_FREE 0 /* Iface indexes start from 1 */
+#define SMP_GONE -1
+
+struct smp_ent {
+	struct nlr_sample sample;
+	struct nlr_rates rates;
+};
+
+struct smp_iface {
+	int idx; /* Or SMP_FREE, SMP_GONE */
+	unsigned gen; /* Poll when the iface was seen last */
+	unsigned head; /* Number of written entries */
+	struct smp_ent *ring;
+};
+
+struct nlr_sampler {
+	int tfd;
+	unsigned depth; /* Power of 2 */
+	double alpha;
+	struct smp_iface *ifaces;
+	unsigned size; /* Power of 2 */
+	int max_ifaces, n;
+	unsigned gen;
+	uint64_t ts; /* Of the current poll */
+	int full; /* The table is full, it's reported once */
+};
+
+static unsigned smp_hash(int idx)
+{
+	return (unsigned)idx * 2654435761u;
+}
+
+static struct smp_iface *smp_find(struct nlr_sampler *s, int idx)
+{
+	struct smp_iface *ifc;
+	unsigned i, h;
+	int v;
+
+	for (i = 0, h = smp_hash(idx); i < s->size; i++, h++) {
+		ifc = &s->ifaces[h & (s->size - 1)];
+		v = __atomic_load_n(&ifc->idx, __ATOMIC_ACQUIRE);
+		if (v == idx)
+			return ifc;
+		if (v == SMP_FREE)
+			break;
+	}
+
+	return NULL;
+}
+
+/* Find or add the iface, only the poller calls it. */
+static struct smp_iface *smp_get(struct nlr_sampler *s, int idx)
+{
+	struct smp_iface *ifc, *slot = NULL;
+	unsigned i, h;
+
+	for (i = 0, h = smp_hash(idx); i < s->size; i++, h++) {
+		ifc = &s->ifaces[h & (s->size - 1)];
+		if (ifc->idx == idx)
+			return ifc;
+		if (ifc->idx == SMP_GONE && !slot)
+			slot = ifc;
+		if (ifc->idx == SMP_FREE) {
+			if (!slot)
+				slot = ifc;
+			break;
+		}
+	}
+
+	if (!slot || s->n == s->max_ifaces) {
+		if (!s->full)
+			ERROR("too many ifaces, max is %d", s->max_ifaces);
+		s->full = 1;
+		return NULL;
+	}
+
+	if (!slot->ring) {
+		slot->ring = malloc(s->depth * sizeof(*slot->ring));
+		if (!slot->ring) {
+			ERRNO("failed to alloc ring of iface %d", idx);
+			return NULL;
+		}
+	}
+
+	__atomic_store_n(&slot->head, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->idx, idx, __ATOMIC_RELEASE);
+	s->n++;
+
+	return slot;
+}
+
+/*
+ * Counters are 64-bit, but drivers with 32-bit counters wrap at 4G: if
+ * the previous value fits 32 bits, assume such a wrap.
+ */
+static uint64_t counter_delta(uint64_t prev, uint64_t cur)
+{
+	if (cur >= prev)
+		return cur - prev;
+	if (prev <= 0xffffffffull)
+		return cur + (0x100000000ull - prev);
+	return cur - prev;
+}
+
+static double ewma(double avg, double v, double alpha, int first)
+{
+	return first ? v : avg + alpha * (v - avg);
+}
+
+static void smp_rates(struct nlr_sampler *s, struct smp_ent *prev,
+		      struct smp_ent *e, int first)
+{
+	struct nlr_link_stats *a = &prev->sample.stats, *b = &e->sample.stats;
+	struct nlr_rates *r = &e->rates, *p = &prev->rates;
+	double dt = (e->sample.ts - prev->sample.ts) / 1e9;
+
+	if (dt <= 0) {
+		*r = *p;
+		return;
+	}
+
+	r->rx_bps = counter_delta(a->rx_bytes, b->rx_bytes) * 8 / dt;
+	r->tx_bps = counter_delta(a->tx_bytes, b->tx_bytes) * 8 / dt;
+	r->rx_pps = counter_delta(a->rx_packets, b->rx_packets) / dt;
+	r->tx_pps = counter_delta(a->tx_packets, b->tx_packets) / dt;
+
+	r->rx_bps_avg = ewma(p->rx_bps_avg, r->rx_bps, s->alpha, first);
+	r->tx_bps_avg = ewma(p->tx_bps_avg, r->tx_bps, s->alpha, first);
+	r->rx_pps_avg = ewma(p->rx_pps_avg, r->rx_pps, s->alpha, first);
+	r->tx_pps_avg = ewma(p->tx_pps_avg, r->tx_pps, s->alpha, first);
+}
+
+static int sample_cb(struct nlr_link_stats *stats, void *_s)
+{
+	struct nlr_sampler *s = (struct nlr_sampler *)_s;
+	struct smp_iface *ifc;
+	struct smp_ent *e;
+	unsigned h;
+
+	ifc = smp_get(s, stats->iface_idx);
+	if (!ifc)
+		return 0;
+	ifc->gen = s->gen;
+
+	h = ifc->head;
+	e = &ifc->ring[h & (s->depth - 1)];
+	/*
+	 * The entry is rewritten only after the previous head (or idx of a
+	 * reused slot) is visible, like the write side of a seqlock: else a
+	 * reader could see new data with an old head.
+	 */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->sample.ts = s->ts;
+	e->sample.stats = *stats;
+	if (h)
+		smp_rates(s, &ifc->ring[(h - 1) & (s->depth - 1)], e, h == 1);
+	else
+		memset(&e->rates, 0, sizeof(e->rates));
+
+	__atomic_store_n(&ifc->head, h + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int smp_sample(struct nlr_sampler *s)
+{
+	struct timespec ts;
+	struct smp_iface *ifc;
+	unsigned i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	s->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	s->gen++;
+
+	if (nlr_foreach_link_stats(-1, sample_cb, s))
+		return -1;
+
+	/* Forget gone ifaces */
+	for (i = 0; i < s->size; i++) {
+		ifc = &s->ifaces[i];
+		if (ifc->idx > 0 && ifc->gen != s->gen) {
+			DEBUG("iface %d is gone", ifc->idx);
+			__atomic_store_n(&ifc->idx, SMP_GONE, __ATOMIC_RELEASE);
+			s->n--;
+			s->full = 0;
+		}
+	}
+
+	return 0;
+}
+
+struct nlr_sampler *nlr_sampler_open(int interval_ms, int depth,
+				     int max_ifaces, double alpha)
+{
+	struct nlr_sampler *s;
+	struct itimerspec its;
+
+	if (interval_ms <= 0 || depth < 2 || max_ifaces <= 0) {
+		ERROR("invalid sampler params");
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		ERRNO("failed to alloc sampler");
+		return NULL;
+	}
+	s->tfd = -1;
+
+	/* An entry may be being rewritten, it can't be read */
+	for (s->depth = 2; s->depth < depth + 1; s->depth *= 2)
+		;
+	for (s->size = 16; s->size < 2 * max_ifaces; s->size *= 2)
+		;
+	s->max_ifaces = max_ifaces;
+	s->alpha = alpha > 0 && alpha <= 1 ? alpha : 0.125;
+
+	s->ifaces = calloc(s->size, sizeof(*s->ifaces));
+	if (!s->ifaces) {
+		ERRNO("failed to alloc iface table");
+		goto err;
+	}
+
+	s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s->tfd < 0) {
+		ERRNO("failed to create timerfd");
+		goto err;
+	}
+
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(s->tfd, 0, &its, NULL)) {
+		ERRNO("failed to set timer");
+		goto err;
+	}
+
+	/* The first sample now, so there are rates after the first tick */
+	if (smp_sample(s))
+		goto err;
+
+	return s;
+
+err:
+	nlr_sampler_close(s);
+	return NULL;
+}
+
+void nlr_sampler_close(struct nlr_sampler *s)
+{
+	unsigned i;
+
+	if (!s)
+		return;
+
+	if (s->tfd >= 0)
+		close(s->tfd);
+	if (s->ifaces) {
+		for (i = 0; i < s->size; i++)
+			free(s->ifaces[i].ring);
+		free(s->ifaces);
+	}
+	free(s);
+}
+
+int nlr_sampler_fd(struct nlr_sampler *s)
+{
+	return s->tfd;
+}
+
+int nlr_sampler_poll(struct nlr_sampler *s)
+{
+	uint64_t expired;
+
+	/* Drain the timer, missed ticks are just one interval longer */
+	if (read(s->tfd, &expired, sizeof(expired)) < 0 && errno != EAGAIN) {
+		ERRNO("failed to read timerfd");
+		return -1;
+	}
+
+	return smp_sample(s);
+}
+
+int nlr_sampler_rates(struct nlr_sampler *s, int iface_idx,
+		      struct nlr_rates *rates)
+{
+	struct smp_iface *ifc;
+	unsigned h, h2;
+
+	ifc = smp_find(s, iface_idx);
+	if (!ifc)
+		return -1;
+
+	do {
+		h = __atomic_load_n(&ifc->head, __ATOMIC_ACQUIRE);
+		if (h < 2)
+			return -1;
+		*rates = ifc->ring[(h - 1) & (s->depth - 1)].rates;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ifc->idx, __ATOMIC_RELAXED) != iface_idx)
+			return -1;
+		h2 = __atomic_load_n(&ifc->head, __ATOMIC_RELAXED);
+	} while (h2 - (h - 1) >= s->depth);
+
+	return 0;
+}
+
+int nlr_sampler_history(struct nlr_sampler *s, int iface_idx,
+			struct nlr_sample *v, int n)
+{
+	struct smp_iface *ifc;
+	unsigned h, h2, first, valid, i;
+
+	ifc = smp_find(s, iface_idx);
+	if (!ifc)
+		return -1;
+
+	h = __atomic_load_n(&ifc->head, __ATOMIC_ACQUIRE);
+	if (n < 0)
+		n = 0;
+	if (n > h)
+		n = h;
+	if (n > s->depth - 1)
+		n = s->depth - 1;
+	first = h - n;
+
+	for (i = 0; i < n; i++)
+		v[i] = ifc->ring[(first + i) & (s->depth - 1)].sample;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&ifc->idx, __ATOMIC_RELAXED) != iface_idx)
+		return -1;
+	h2 = __atomic_load_n(&ifc->head, __ATOMIC_RELAXED);
+
+	/* Drop samples overwritten during the copy */
+	valid = h2 - first >= s->depth ? h2 - s->depth + 1 : first;
+	if (valid >= h)
+		return 0;
+	if (valid > first) {
+		memmove(v, v + (valid - first), (h - valid) * sizeof(*v));
+		n = h - valid;
+	}
+
+	return n;
+}
+
+int nlr_sampler_foreach(struct nlr_sampler *s,
+			int (*cb)(int iface_idx, struct nlr_rates *, void *),
+			void *priv)
+{
+	struct nlr_rates rates;
+	unsigned i;
+	int idx;
+
+	for (i = 0; i < s->size; i++) {
+		idx = __atomic_load_n(&s->ifaces[i].idx, __ATOMIC_ACQUIRE);
+		if (idx <= 0 || nlr_sampler_rates(s, idx, &rates))
+			continue;
+		if (cb(idx, &rates, priv))
+			break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef _NLSAMPLER_H
+#define _NLSAMPLER_H
+
+#include <stdint.h>
+
+#include "nlroute.h"
+
+/*
+ * Counters sampler: polls iface counters (one RTM_GETSTATS dump per
+ * interval), keeps the last samples of every iface in a ring buffer and
+ * computes rates and their EWMA averages.
+ *
+ * Only one thread must call nlr_sampler_poll(), but other threads can
+ * read rates and history at the same time: the rings are lock-free, a
+ * reader retries or drops a sample that was overwritten while it was
+ * being copied.
+ */
+
+struct nlr_sample {
+	uint64_t ts; /* CLOCK_MONOTONIC, ns */
+	struct nlr_link_stats stats;
+};
+
+struct nlr_rates {
+	/* Over the last interval */
+	double rx_bps, tx_bps;
+	double rx_pps, tx_pps;
+	/* EWMA of the above */
+	double rx_bps_avg, tx_bps_avg;
+	double rx_pps_avg, tx_pps_avg;
+};
+
+struct nlr_sampler;
+
+/*
+ * Poll every @interval_ms, keep at least @depth last samples of up to
+ * @max_ifaces ifaces. @alpha is the EWMA weight of a new rate, 0 --
+ * default (1/8).
+ */
+struct nlr_sampler *nlr_sampler_open(int interval_ms, int depth,
+				     int max_ifaces, double alpha);
+void nlr_sampler_close(struct nlr_sampler *s);
+
+/*
+ * Timer fd: add it to your poll set and call nlr_sampler_poll() when
+ * it's readable.
+ */
+int nlr_sampler_fd(struct nlr_sampler *s);
+int nlr_sampler_poll(struct nlr_sampler *s);
+
+/* Rates need two samples: return -1 if there aren't yet (or no iface). */
+int nlr_sampler_rates(struct nlr_sampler *s, int iface_idx,
+		      struct nlr_rates *rates);
+/*
+ * Copy up to @n last samples of the iface into @v, the oldest first.
+ * Return number of copied samples or -1 if there is no such iface.
+ */
+int nlr_sampler_history(struct nlr_sampler *s, int iface_idx,
+			struct nlr_sample *v, int n);
+/* Call @cb for every iface that has rates. Stop if it returns non-zero. */
+int nlr_sampler_foreach(struct nlr_sampler *s,
+			int (*cb)(int iface_idx, struct nlr_rates *, void *),
+			void *priv);
+
+#endif
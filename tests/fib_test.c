@@ -0,0 +1,232 @@
+/*
+ * FIB mirror check: random prefixes are added to and deleted from a
+ * scratch table with nlr_fib_update(), lookups are compared with a
+ * brute-force longest prefix match over the same prefixes.
+ *
+ * Needs a netlink socket (nlr_fib_open() dumps the table, it's empty),
+ * but doesn't change anything in the kernel.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "nlroute.h"
+#include "nlfib.h"
+
+#define TABLE 4242 /* Scratch: nothing is installed into it */
+#define MAX_PREFIXES 256
+#define OPS 20000
+#define CHECK_EVERY 10
+#define ADDRS 512
+
+struct ref_prefix {
+	uint32_t dest; /* Host byte order */
+	int plen;
+	in_addr_t gw;
+};
+
+static struct ref_prefix ref[MAX_PREFIXES];
+static int n_ref;
+static int failed;
+
+static uint32_t rnd_state = 12345;
+
+static uint32_t rnd(void)
+{
+	/* xorshift32: the same sequence on every run */
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static uint32_t plen_mask(int plen)
+{
+	return plen ? ~0u << (32 - plen) : 0;
+}
+
+static in_addr_t ref_lookup(uint32_t a)
+{
+	int i, best = -1;
+
+	for (i = 0; i < n_ref; i++) {
+		if ((a & plen_mask(ref[i].plen)) == ref[i].dest
+		    && (best < 0 || ref[i].plen > ref[best].plen))
+			best = i;
+	}
+
+	return best < 0 ? 0 : ref[best].gw;
+}
+
+static int fib_do(struct nlr_fib *fib, int del, uint32_t dest, int plen,
+		  in_addr_t gw)
+{
+	struct nlr_route r;
+
+	memset(&r, 0, sizeof(r));
+	r.table = TABLE;
+	r.type = RTN_UNICAST;
+	r.dest = htonl(dest);
+	r.dest_plen = plen;
+	r.gw = gw;
+
+	return nlr_fib_update(fib, del, &r);
+}
+
+static void ref_add(struct nlr_fib *fib, uint32_t dest, int plen, in_addr_t gw)
+{
+	int i;
+
+	dest &= plen_mask(plen);
+
+	if (fib_do(fib, 0, dest, plen, gw)) {
+		printf("FAIL: add %08x/%d\n", dest, plen);
+		failed++;
+		return;
+	}
+
+	for (i = 0; i < n_ref; i++) {
+		if (ref[i].dest == dest && ref[i].plen == plen) {
+			ref[i].gw = gw;
+			return;
+		}
+	}
+	ref[n_ref].dest = dest;
+	ref[n_ref].plen = plen;
+	ref[n_ref].gw = gw;
+	n_ref++;
+}
+
+static void ref_del(struct nlr_fib *fib, int i)
+{
+	if (fib_do(fib, 1, ref[i].dest, ref[i].plen, ref[i].gw)) {
+		printf("FAIL: del %08x/%d\n", ref[i].dest, ref[i].plen);
+		failed++;
+	}
+	ref[i] = ref[--n_ref];
+}
+
+static void check_addr(struct nlr_fib *fib, uint32_t a, const char *what)
+{
+	const struct nlr_fib_nh *nh;
+	in_addr_t want, got;
+
+	want = ref_lookup(a);
+	nh = nlr_fib_lookup(fib, htonl(a));
+	got = nh ? nh->gw : 0;
+
+	if (got != want) {
+		printf("FAIL: %s: lookup %08x: got %08x, want %08x\n", what, a,
+		       ntohl(got), ntohl(want));
+		failed++;
+	}
+}
+
+static void check(struct nlr_fib *fib, const char *what)
+{
+	static in_addr_t addrs[ADDRS], gws[ADDRS];
+	static int oifs[ADDRS];
+	uint32_t a;
+	int i;
+
+	for (i = 0; i < ADDRS; i++) {
+		/* Near prefix boundaries or anywhere in 10.0.0.0/14 */
+		if (n_ref && i % 2) {
+			a = ref[rnd() % n_ref].dest;
+			a += (rnd() % 3) - 1;
+		} else {
+			a = 0x0a000000 | (rnd() & 0x3ffff);
+		}
+		addrs[i] = htonl(a);
+		check_addr(fib, a, what);
+	}
+
+	nlr_fib_lookup_batch(fib, addrs, ADDRS, oifs, gws);
+	for (i = 0; i < ADDRS; i++) {
+		if (gws[i] != ref_lookup(ntohl(addrs[i]))) {
+			printf("FAIL: %s: batch lookup %08x\n", what,
+			       ntohl(addrs[i]));
+			failed++;
+			break;
+		}
+	}
+}
+
+/*
+ * A group of /17 siblings with the same nexthop is uniform, but it must
+ * not be folded into tbl16: deletion of one /17 wouldn't find it there.
+ */
+static void test_sibling_fold(struct nlr_fib *fib)
+{
+	in_addr_t gw = inet_addr("1.1.1.1");
+
+	ref_add(fib, 0x0a000000, 17, gw);
+	ref_add(fib, 0x0a008000, 17, gw);
+	ref_add(fib, 0x0a000500, 24, gw);
+	ref_del(fib, n_ref - 1);
+	ref_del(fib, 0);
+
+	check_addr(fib, 0x0a000101, "sibling fold");
+	check_addr(fib, 0x0a008101, "sibling fold");
+
+	while (n_ref)
+		ref_del(fib, 0);
+	check_addr(fib, 0x0a008101, "sibling fold");
+}
+
+static void test_random(struct nlr_fib *fib)
+{
+	static const int plens[] = { 8, 12, 15, 16, 17, 20, 23, 24, 25, 28,
+				     30, 32 };
+	uint32_t dest;
+	int i, plen;
+	char what[32];
+
+	for (i = 0; i < OPS; i++) {
+		if (n_ref == MAX_PREFIXES || n_ref && rnd() % 5 < 2) {
+			ref_del(fib, rnd() % n_ref);
+		} else {
+			plen = plens[rnd() % (sizeof(plens) / sizeof(plens[0]))];
+			dest = 0x0a000000 | (rnd() & 0x3ffff);
+			/* Few nexthops, so groups often become uniform */
+			ref_add(fib, dest, plen, htonl(0x01010100 + rnd() % 3));
+		}
+
+		if (i % CHECK_EVERY == 0) {
+			snprintf(what, sizeof(what), "op %d", i);
+			check(fib, what);
+		}
+		if (failed)
+			return;
+	}
+
+	while (n_ref)
+		ref_del(fib, 0);
+	check(fib, "empty");
+}
+
+int main(void)
+{
+	struct nlr_fib *fib;
+
+	if (nlr_init())
+		return 1;
+
+	fib = nlr_fib_open(TABLE);
+	if (!fib)
+		return 1;
+
+	test_sibling_fold(fib);
+	if (!failed)
+		test_random(fib);
+
+	nlr_fib_close(fib);
+	nlr_fin();
+
+	printf("fib_test: %s\n", failed ? "FAILED" : "ok");
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Routes via a nexthop object: dumps show them with the gw/oif of the
+ * nexthop, deleting and syncing such dumped routes must still work.
+ *
+ * Installs a nexthop on "lo" and routes into a scratch table, removes
+ * them at exit.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/rtnetlink.h>
+
+#include "nlroute.h"
+
+#define TABLE 4243 /* Scratch */
+#define NH_ID 4243
+
+static int failed;
+
+static void fail(const char *what, int err)
+{
+	printf("FAIL: %s: %d\n", what, err);
+	failed++;
+}
+
+static void route_init(struct nlr_route *r, const char *dest)
+{
+	memset(r, 0xff, sizeof(*r));
+	r->nhs = NULL;
+	r->n_nhs = 0;
+	r->pnext = NULL;
+	r->table = TABLE;
+	r->dest = inet_addr(dest);
+	r->dest_plen = 24;
+	r->nh_id = NH_ID;
+}
+
+static struct nlr_route *get_routes(void)
+{
+	struct nlr_route filter;
+	int err;
+
+	memset(&filter, 0xff, sizeof(filter));
+	filter.nhs = NULL;
+	filter.n_nhs = 0;
+	filter.pnext = NULL;
+	filter.table = TABLE;
+
+	return nlr_get_routes(&filter, &err);
+}
+
+static int count_routes(void)
+{
+	struct nlr_route *list, *r;
+	int n = 0;
+
+	list = get_routes();
+	for (r = list; r; r = r->pnext)
+		n++;
+	nlr_free_routes(list);
+
+	return n;
+}
+
+/* Delete the dumped route as is. */
+static void test_del(void)
+{
+	struct nlr_route r, *list;
+	int err;
+
+	route_init(&r, "10.99.1.0");
+	if (nlr_add_routes(&r, 1, &err)) {
+		fail("add", err);
+		return;
+	}
+
+	list = get_routes();
+	if (!list || list->nh_id != NH_ID) {
+		fail("dump", 0);
+		nlr_free_routes(list);
+		return;
+	}
+	if (nlr_del_routes(list, 1, &err))
+		fail("del of a dumped route", err);
+	nlr_free_routes(list);
+
+	if (count_routes())
+		fail("route is left after del", 0);
+}
+
+/* Sync: the same route is unchanged, then it's deleted from the dump. */
+static void test_sync(void)
+{
+	struct nlr_route r;
+	struct nlr_sync_stats st;
+
+	route_init(&r, "10.99.2.0");
+	if (nlr_sync_routes(&r, 1, TABLE, RTPROT_STATIC, &st) || st.added != 1)
+		fail("sync add", st.failed);
+
+	if (nlr_sync_routes(&r, 1, TABLE, RTPROT_STATIC, &st)
+	    || st.unchanged != 1)
+		fail("sync unchanged", st.failed);
+
+	if (nlr_sync_routes(NULL, 0, TABLE, RTPROT_STATIC, &st)
+	    || st.deleted != 1)
+		fail("sync del", st.failed);
+
+	if (count_routes())
+		fail("route is left after sync", 0);
+}
+
+int main(void)
+{
+	struct nlr_nexthop nh;
+
+	if (nlr_init())
+		return 1;
+
+	memset(&nh, 0, sizeof(nh));
+	nh.id = NH_ID;
+	nh.proto = -1;
+	nh.oif = nlr_iface_idx("lo");
+	if (nlr_add_nexthop(&nh)) {
+		printf("route_test: no nexthop objects, skipped\n");
+		nlr_fin();
+		return 0;
+	}
+
+	test_del();
+	test_sync();
+
+	/* Routes using it go away too */
+	nlr_del_nexthop(NH_ID);
+	nlr_fin();
+
+	printf("route_test: %s\n", failed ? "FAILED" : "ok");
+
+	return failed ? 1 : 0;
+}